@@ -0,0 +1,102 @@
+/******************************************************************************
+ * Copyright (C) 2019 Synopsys, Inc.
+ * This source code is licensed under the MIT license found in the
+ * LICENSE file in the root directory of this source tree.
+ ******************************************************************************/
+
+#include "clock.h"
+
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+// Compares the timer tick conversion of clock_converter against the plain
+// 128 bit division it replaces: checks that both agree on every input and
+// reports the time per conversion of each.
+
+using namespace ocx;
+using namespace ocx::arm;
+
+static const u64 CLOCKS[] = {
+    1000000ull, 19200000ull, 24000000ull, 62500000ull, 100000000ull,
+    1000000000ull, 3000000000ull,
+};
+
+static const size_t NUM_INPUTS = 1 << 16;
+static const int    NUM_ROUNDS = 16;
+
+static u64 xorshift(u64& state) {
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state;
+}
+
+// the fastest of several runs is the least disturbed by other load
+static const int    NUM_RUNS   = 8;
+
+template <typename FUNC>
+static double bench(const std::vector<u64>& inputs, u64& sum, FUNC func) {
+    using namespace std::chrono;
+    double best = 0.0;
+    for (int run = 0; run < NUM_RUNS; run++) {
+        auto start = steady_clock::now();
+        for (int round = 0; round < NUM_ROUNDS; round++)
+            for (u64 val : inputs)
+                sum += func(val);
+        auto ns = duration_cast<nanoseconds>(steady_clock::now() - start);
+        double t = (double)ns.count() / ((double)inputs.size() * NUM_ROUNDS);
+        if (run == 0 || t < best)
+            best = t;
+    }
+
+    return best;
+}
+
+int main() {
+    u64 state = 0x9e3779b97f4a7c15ull;
+    std::vector<u64> inputs(NUM_INPUTS);
+    for (u64& val : inputs) // times of up to about 50 days
+        val = xorshift(state) >> 22;
+
+    u64 sum = 0;
+    bool overflow;
+    for (u64 clock : CLOCKS) {
+        clock_converter conv;
+        conv.setup(clock);
+
+        for (u64 val : inputs) {
+            bool ovf1, ovf2;
+            if (conv.ps_to_ticks(val, ovf1) !=
+                    mult_div_128(val, clock, PS_PER_SEC, ovf2) ||
+                conv.ticks_to_ps(val, ovf1) !=
+                    mult_div_128_round_up(val, PS_PER_SEC, clock, ovf2)) {
+                fprintf(stderr, "mismatch at %" PRIu64 " Hz for %" PRIu64
+                        "\n", clock, val);
+                return EXIT_FAILURE;
+            }
+        }
+
+        double div_ps = bench(inputs, sum, [&](u64 val) {
+            return mult_div_128(val, clock, PS_PER_SEC, overflow);
+        });
+        double fast_ps = bench(inputs, sum, [&](u64 val) {
+            return conv.ps_to_ticks(val, overflow);
+        });
+        double div_ticks = bench(inputs, sum, [&](u64 val) {
+            return mult_div_128_round_up(val, PS_PER_SEC, clock, overflow);
+        });
+        double fast_ticks = bench(inputs, sum, [&](u64 val) {
+            return conv.ticks_to_ps(val, overflow);
+        });
+
+        printf("%10" PRIu64 " Hz  ps_to_ticks %6.2f ns (div %6.2f ns)  "
+               "ticks_to_ps %6.2f ns (div %6.2f ns)\n", clock, fast_ps,
+               div_ps, fast_ticks, div_ticks);
+    }
+
+    // keep the conversions from being optimized away
+    return sum == 42 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
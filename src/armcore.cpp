@@ -16,7 +16,11 @@
 #include <chrono>
 #include <string>
 #include <vector>
+#include <map>
 #include <memory>
+#include <thread>
+#include <unordered_map>
+#include <cctype>
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
@@ -29,6 +33,11 @@
 #include <stdint.h>
 
 #include "modeldb.h"
+#include "extensions.h"
+#include "bbtrace.h"
+#include "profiler.h"
+#include "clock.h"
+#include "dirtymap.h"
 
 #ifdef _MSC_VER
 #include <io.h>
@@ -76,12 +85,14 @@
 namespace ocx { namespace arm {
 
     using std::max;
+    using std::min;
     using std::string;
     using std::pair;
     using std::move;
     using std::shared_ptr;
-
-    const u64 PS_PER_SEC = 1000000000000ull;
+    using std::map;
+    using std::unordered_map;
+    using std::unique_ptr;
 
     const u64 PAGE_BITS = 12;
     const u64 PAGE_SIZE = 1ull << PAGE_BITS;
@@ -89,6 +100,38 @@ namespace ocx { namespace arm {
     const u64 ADDR_BITS = 48;
     const u64 ADDR_SIZE = 1ull << ADDR_BITS;
 
+    const u64 SHC_READ_DMI_MAX = 1ull << 20;
+    const u64 SHC_READ_BUF_MAX = 1ull << 16;
+
+    const size_t CONSOLE_BUFSZ = 4096;
+
+    const size_t TRACE_BATCH_SIZE = 4096;
+
+    // retranslating more pages than this is more expensive than tb_flush
+    const u64 TB_FLUSH_MAX_PAGES = 256;
+
+    // upper bound on the pages prefaulted per creation or reset (256 MiB)
+    const u64 PREFAULT_MAX_PAGES = 1ull << 16;
+
+    // distance between host memory reads when faulting in prefaulted pages
+    const u64 PREFAULT_STRIDE = 64;
+
+    // deferred TLB page flushes beyond this turn into a full flush
+    const size_t TLB_FLUSH_MAX_PAGES = 64;
+
+    // polling loops spanning more blocks than this are not detected
+    const u64 POLL_MAX_BLOCKS = 8;
+
+    // time per instruction assumed by step_until without local_time_clock
+    const u64 DEFAULT_PS_PER_INSN = 1000;
+
+    // internal stop reason: a timer got scheduled before the end of the
+    // current step_until run, which needs a shorter budget
+    const int STOP_RESCHEDULE = -1;
+
+    // idxmap covering every MMU index of the translator
+    const uint16_t TLB_ALL_MMUIDX = 0xffff;
+
     static const int IRQMAP[] = {
         UC_IRQID_AARCH64_NIRQ, // NIRQ on line 0
         UC_IRQID_AARCH64_FIRQ, // FIRQ on line 1
@@ -103,6 +146,90 @@ namespace ocx { namespace arm {
         return (1ull << width) - 1;
     }
 
+    static size_t page_chunk(u64 addr, u64 size) {
+        return (size_t)std::min(size, PAGE_SIZE - (addr & (PAGE_SIZE - 1)));
+    }
+
+    static bool write_all(int fd, const void* data, size_t size) {
+        const char* ptr = (const char*)data;
+        while (size > 0) {
+            ssize_t n = write(fd, ptr, (unsigned int)size);
+            if (n <= 0)
+                return false;
+            ptr += n;
+            size -= n;
+        }
+
+        return true;
+    }
+
+    static bool read_all(int fd, void* data, size_t size) {
+        char* ptr = (char*)data;
+        while (size > 0) {
+            ssize_t n = read(fd, ptr, (unsigned int)size);
+            if (n <= 0)
+                return false;
+            ptr += n;
+            size -= n;
+        }
+
+        return true;
+    }
+
+    template <typename T>
+    static void put_raw(std::vector<u8>& buf, const T& val) {
+        const u8* p = (const u8*)&val;
+        buf.insert(buf.end(), p, p + sizeof(T));
+    }
+
+    template <typename T>
+    static bool get_raw(const u8*& pos, const u8* end, T& val) {
+        if ((size_t)(end - pos) < sizeof(T))
+            return false;
+        memcpy(&val, pos, sizeof(T));
+        pos += sizeof(T);
+        return true;
+    }
+
+    // Checkpoint stream: header followed by sections, each one made of a
+    // u32 tag, a u64 payload size and the payload. All numbers are stored
+    // in host byte order. Readers skip sections they do not know.
+    //
+    //   header              "OCXCP" version
+    //   CKPT_MODEL  0x01    model name
+    //   CKPT_REGS   0x02    { u32 uc regid, u32 size, value }*
+    //   CKPT_CORE   0x03    u64 insn count, u64 local time ps,
+    //                       u8 idle, u8 exclusive monitor open
+    //   CKPT_TIMER  0x04    u64 timer clock hz,
+    //                       u64 deadline ps [ARM_TIMER_NUM], ~0 if off
+    //   CKPT_END    0x00    empty
+    //
+    // CKPT_REGS holds every register of the model's register database,
+    // including the MMU and generic timer system registers.
+    static const u8 CKPT_MAGIC[] = { 'O', 'C', 'X', 'C', 'P' };
+    static const u8 CKPT_VERSION = 1;
+
+    enum ckpt_section {
+        CKPT_END   = 0x00,
+        CKPT_MODEL = 0x01,
+        CKPT_REGS  = 0x02,
+        CKPT_CORE  = 0x03,
+        CKPT_TIMER = 0x04,
+    };
+
+    static void put_section(std::vector<u8>& buf, u32 tag,
+                            const std::vector<u8>& payload) {
+        put_raw(buf, tag);
+        put_raw(buf, (u64)payload.size());
+        buf.insert(buf.end(), payload.begin(), payload.end());
+    }
+
+    static u64 host_ns() {
+        using namespace std::chrono;
+        auto now = steady_clock::now();
+        return duration_cast<nanoseconds>(now.time_since_epoch()).count();
+    }
+
     static u64 realtime_ms() {
         using namespace std::chrono;
         auto now = high_resolution_clock::now();
@@ -132,8 +259,97 @@ namespace ocx { namespace arm {
         TLB_FLUSH_PAGE          = 0x02,
         TLB_FLUSH_MMUIDX        = 0x03,
         TLB_FLUSH_PAGE_MMUIDX   = 0x04,
+        TLB_FLUSH_BATCH         = 0x05,
+    };
+
+    enum perf_counter {
+        PERF_TRANSPORT = 0,
+        PERF_TRANSPORT_NS,
+        PERF_DMI_GRANTED,
+        PERF_DMI_REFUSED,
+        PERF_DMI_NS,
+        PERF_DMI_CACHED,
+        PERF_TLB_FLUSH,
+        PERF_TLB_FLUSH_PAGE,
+        PERF_TLB_FLUSH_MMUIDX,
+        PERF_TLB_FLUSH_PAGE_MMUIDX,
+        PERF_TLB_BROADCAST,
+        PERF_TLB_SKIPPED,
+        PERF_TLB_NARROWED,
+        PERF_IDLE,
+        PERF_POLL,
+        PERF_BROADCAST_NS,
+        PERF_SYSCALL,
+        PERF_TIME,
+        PERF_TIME_NS,
+        PERF_SCHEDULE,
+        PERF_SCHEDULE_NS,
+        PERF_SIGNAL,
+        PERF_SIGNAL_NS,
+        PERF_NUM
+    };
+
+    static const char* const PERF_NAMES[PERF_NUM] = {
+        "transport",
+        "transport_ns",
+        "dmi_granted",
+        "dmi_refused",
+        "dmi_ns",
+        "dmi_cached",
+        "tlb_flush",
+        "tlb_flush_page",
+        "tlb_flush_mmuidx",
+        "tlb_flush_page_mmuidx",
+        "tlb_broadcast",
+        "tlb_flush_skipped",
+        "tlb_flush_narrowed",
+        "idle",
+        "polling",
+        "broadcast_ns",
+        "syscall",
+        "time",
+        "time_ns",
+        "schedule",
+        "schedule_ns",
+        "signal",
+        "signal_ns",
+    };
+
+    static bool is_true(const char* value) {
+        if (value == nullptr)
+            return false;
+        return strcmp(value, "1") == 0 || strcmp(value, "true") == 0 ||
+               strcmp(value, "yes") == 0 || strcmp(value, "on") == 0;
+    }
+
+    // general purpose registers hashed at the head of polling loops
+    static const int POLL_REGS_A64[] = {
+        UC_ARM64_REG_X0, UC_ARM64_REG_X1, UC_ARM64_REG_X2, UC_ARM64_REG_X3,
+        UC_ARM64_REG_X4, UC_ARM64_REG_X5, UC_ARM64_REG_X6, UC_ARM64_REG_X7,
+        UC_ARM64_REG_X8, UC_ARM64_REG_X9, UC_ARM64_REG_X10, UC_ARM64_REG_X11,
+        UC_ARM64_REG_X12, UC_ARM64_REG_X13, UC_ARM64_REG_X14,
+        UC_ARM64_REG_X15, UC_ARM64_REG_X16, UC_ARM64_REG_X17,
+        UC_ARM64_REG_X18, UC_ARM64_REG_X19, UC_ARM64_REG_X20,
+        UC_ARM64_REG_X21, UC_ARM64_REG_X22, UC_ARM64_REG_X23,
+        UC_ARM64_REG_X24, UC_ARM64_REG_X25, UC_ARM64_REG_X26,
+        UC_ARM64_REG_X27, UC_ARM64_REG_X28, UC_ARM64_REG_X29,
+        UC_ARM64_REG_X30, UC_ARM64_REG_SP,
     };
 
+    static const int POLL_REGS_A32[] = {
+        UC_ARM_REG_R0, UC_ARM_REG_R1, UC_ARM_REG_R2, UC_ARM_REG_R3,
+        UC_ARM_REG_R4, UC_ARM_REG_R5, UC_ARM_REG_R6, UC_ARM_REG_R7,
+        UC_ARM_REG_R8, UC_ARM_REG_R9, UC_ARM_REG_R10, UC_ARM_REG_R11,
+        UC_ARM_REG_R12, UC_ARM_REG_SP, UC_ARM_REG_LR,
+    };
+
+    static u64 fnv1a(u64 hash, const void* data, size_t size) {
+        const u8* p = (const u8*)data;
+        for (size_t i = 0; i < size; i++)
+            hash = (hash ^ p[i]) * 0x100000001b3ull;
+        return hash;
+    }
+
     enum arm_generic_timer_type {
         ARM_TIMER_PHYS = 0,
         ARM_TIMER_VIRT = 1,
@@ -145,7 +361,17 @@ namespace ocx { namespace arm {
     class core :
         public ocx::core,
         public ocx::core_inv_range_extension,
-        public ocx::core_trace_insns_extension
+        public ocx::core_trace_insns_extension,
+        public ocx::arm::core_bulk_regs_extension,
+        public ocx::arm::core_trace_filter_extension,
+        public ocx::arm::core_branch_trace_extension,
+        public ocx::arm::core_profile_extension,
+        public ocx::arm::core_perf_counters_extension,
+        public ocx::arm::core_idle_extension,
+        public ocx::arm::core_stop_reason_extension,
+        public ocx::arm::core_step_until_extension,
+        public ocx::arm::core_checkpoint_extension,
+        public ocx::arm::core_dirty_pages_extension
     {
     public:
         core() = delete;
@@ -205,6 +431,56 @@ namespace ocx { namespace arm {
 
         virtual bool trace_insns(bool on) override;
 
+        // bulk register access
+        virtual u64  regs_size(const u64* regids, u64 count) override;
+        virtual bool read_regs(const u64* regids, u64 count,
+                               void* buf) override;
+        virtual bool write_regs(const u64* regids, u64 count,
+                                const void* buf) override;
+
+        // filtered instruction tracing
+        virtual bool trace_insns_filtered(const trace_range* ranges,
+                                          u64 count, u32 el_mask,
+                                          i64 asid) override;
+
+        // compressed branch tracing
+        virtual bool branch_trace_start(int fd) override;
+        virtual void branch_trace_stop() override;
+        virtual const u8* branch_trace_data(u64& size) override;
+        virtual bool branch_trace_decode(const u8* data, u64 size,
+                                         branch_trace_listener& l) override;
+
+        // hot block profiling
+        virtual bool profile_start(bool callstacks) override;
+        virtual void profile_stop() override;
+        virtual void profile_reset() override;
+        virtual bool profile_dump(int fd, u64 limit) override;
+        virtual bool profile_dump_folded(int fd) override;
+
+        // performance counters
+        virtual u64         num_perf_counters() override;
+        virtual const char* perf_counter_name(u64 idx) override;
+        virtual u64         perf_counter(u64 idx) override;
+        virtual void        reset_perf_counters() override;
+
+        // idle fast-forward
+        virtual bool idle(u64& deadline_ps) override;
+        virtual u64  idle_cycles() override;
+
+        virtual int stop_reason() override;
+
+        virtual u64 step_until(u64 target_ps, u64 num_insn) override;
+
+        // checkpointing
+        virtual bool checkpoint_save(int fd) override;
+        virtual bool checkpoint_restore(int fd) override;
+
+        // dirty page tracking
+        virtual bool dirty_pages_track(bool on) override;
+        virtual u64  dirty_pages_fetch(u64* pages, u64 max) override;
+        virtual u64  dirty_pages_fetch_bitmap(u64 start, u64 npages,
+                                              u64* bitmap) override;
+
     private:
         uc_engine*   m_uc;
         env&         m_env;
@@ -218,18 +494,291 @@ namespace ocx { namespace arm {
         u64          m_coreid;
 
         env_trace_insns_extension* m_trace_insns;
-        uc_hook      m_trace_insns_hook;
+        std::vector<uc_hook>       m_trace_insns_hooks;
+
+        env_trace_insns_batch_extension* m_trace_batch;
+        std::vector<trace_insn_record>   m_trace_buf;
+        size_t                           m_trace_len;
+
+        std::vector<trace_range> m_trace_ranges;
+        u32                      m_trace_el_mask;
+        i64                      m_trace_asid;
+
+        bool trace_insns_hook(void* func, u64 start, u64 end);
+        bool trace_insns_remove();
+        void trace_insns_off();
+        void flush_trace_insns();
+        u64  current_asid() const;
+
+        unique_ptr<bbtrace_writer> m_bbtrace;
+        uc_hook                    m_bbtrace_hook;
+
+        int  bbtrace_isa() const;
+        bool bbtrace_exception(u64 addr, u64& ret) const;
+        void branch_trace_run(u64 addr, u64 size, int isa,
+                              branch_trace_listener& l);
+
+        // the basic block trace callback is shared between the env and
+        // the builtin profiler
+        bool m_trace_bb;
+
+        unique_ptr<bbprofile> m_profile;
+        bool                  m_profile_on;
+        bool                  m_profile_stacks;
+        bbprofile_entry       m_profile_prev;
+
+        // reciprocals of the generic timer frequency
+        clock_converter m_timer_clock;
+
+        // local time-keeping: while running, counter reads are served from
+        // the env time at the start of the step plus a fixed time per
+        // retired instruction; zero ps per instruction disables this
+        u64 m_local_ps_per_insn;
+        u64 m_local_time_ps;
+
+        void setup_local_time();
+        u64  env_time_ps();
+
+        // idle fast-forward: a WFI without any interrupt line raised parks
+        // the core, step then returns right away until interrupt() raises
+        // a line or a timer event gets notified()
+        bool m_idle_skip;
+        bool m_idle;
+        u64  m_irq_lines;
+        u64  m_idle_start_ps;
+        u64  m_idle_cycles;
+        u64  m_timer_deadline[ARM_TIMER_NUM];
+
+        void idle_enter();
+        void idle_leave();
+        u64  next_timer_deadline() const;
+
+        // end time of the current step_until run, UINT64_MAX otherwise;
+        // timers scheduled before it only end the step while the step is
+        // run by step_until
+        u64  m_run_deadline_ps;
+        bool m_in_step_until;
+
+        // the first reason to stop the current step wins
+        int  m_stop_reason;
+        void stop_for(int reason);
+
+        // polling loop detection: the loop head is found by following
+        // blocks until one repeats within POLL_MAX_BLOCKS; iterations that
+        // cannot write memory, see the same MMIO read data and arrive at
+        // the loop head with the same general purpose registers as the one
+        // before count towards m_poll_limit, which then ends the step;
+        // loads via DMI are not seen, but what the loop makes of them ends
+        // up in registers, while loops that compute something (e.g. delay
+        // loops counting down) change them
+        u64  m_poll_limit;
+        u64  m_poll_head;
+        u64  m_poll_iters;
+        u64  m_poll_blocks;
+        bool m_poll_clean;
+        u64  m_poll_hash;
+        u64  m_poll_prev_hash;
+        unordered_map<u64, bool> m_poll_writes;
+
+        void poll_reset(u64 head);
+        void poll_block(u64 pc);
+        bool poll_block_writes(u64 pc);
+        u64  poll_regs_hash(u64 hash) const;
+
+        u64  m_perf[PERF_NUM];
+        bool m_perf_timing;
+
+        // adds the host time of its scope to a *_NS counter if enabled
+        class perf_timer {
+        public:
+            perf_timer(core* cpu, int idx):
+                m_counter(cpu->m_perf_timing ? &cpu->m_perf[idx] : nullptr),
+                m_start(m_counter ? host_ns() : 0) {
+            }
+
+            ~perf_timer() {
+                if (m_counter)
+                    *m_counter += host_ns() - m_start;
+            }
+
+        private:
+            u64* m_counter;
+            u64  m_start;
+        };
+
+        void dump_perf_counters();
+
+        struct flush_page_mmuidx_args {
+            u64 addr;
+            uint16_t idxmap;
+        };
+
+        // TLB flushes requested by the guest are applied locally right away
+        // but only broadcast to the other cores once at the end of the step,
+        // coalesced into page ranges; an idxmap of zero means all indices
+        struct flush_range {
+            u64 addr;
+            u64 pages;
+            uint16_t idxmap;
+        };
+
+        struct flush_batch {
+            const core* origin;
+            bool all;
+            uint16_t idxmap;
+            std::vector<flush_range> ranges;
+        };
+
+        bool                                  m_tlb_defer;
+        bool                                  m_tlb_all;
+        uint16_t                              m_tlb_idxmap;
+        std::vector<flush_page_mmuidx_args>   m_tlb_pages;
+        std::vector<shared_ptr<flush_batch>>  m_tlb_pool;
+
+        // MMU indices known to hold no TLB entries: set when a remote
+        // flush empties them between steps, cleared by every step that
+        // enters the emulator; flushes arriving during a step leave it
+        // alone, as the TLB may be refilled right after them
+        uint16_t                              m_tlb_clean;
+
+        void remote_tlb_flush();
+        void remote_tlb_flush_mmuidx(uint16_t idxmap);
+        void remote_tlb_flush_page(u64 addr, uint16_t idxmap);
+
+        void queue_tlb_flush_page(u64 addr, uint16_t idxmap);
+        void broadcast_tlb_flushes();
+        void apply_tlb_flush(const flush_batch& batch);
+        shared_ptr<flush_batch> alloc_flush_batch();
+
+        bool setup_bb_trace();
+        void profile_block(u64 pc);
+        void profile_classify(bbprofile_entry& e);
+        void profile_detail(bool on);
+
+        // every scalar register maps to a slot holding the value of its
+        // underlying unicorn register, so that bitfield views share one read
+        std::vector<int>   m_reg_slot;
+        std::vector<int>   m_slot_regid;
+        std::vector<u64>   m_slot_vals;
+        std::vector<u8>    m_slot_used;
+        std::vector<int>   m_batch_ids;
+        std::vector<void*> m_batch_vals;
+
+        void setup_reg_slots();
+        bool collect_reg_slots(const u64* regids, u64 count);
+
+        bool checkpoint_regs(std::vector<u8>& buf);
+        bool restore_regs(const u8* data, size_t size);
+
+        // execution state is cached between steps and only re-read from
+        // unicorn after it could have changed (execution, register writes
+        // or reset); while running it must always be read afresh
+        struct exec_state {
+            bool valid;
+            bool aarch64;
+            bool thumb;
+            u8   el;
+        };
+
+        mutable exec_state m_state;
+        bool               m_running;
+
+        const exec_state& state() const;
+        void invalidate_state() { m_state.valid = false; }
 
         bool is_aarch64() const;
         bool is_aarch32() const;
         bool is_thumb()   const;
+        u8   current_el() const;
 
         csh lookup_disassembler() const;
         u64 get_program_counter() const;
 
+        // pages the env was asked to protect because they hold code; debug
+        // writes to those must be seen by the env and may not bypass it;
+        // with warm resets, the hash of their contents is kept as well
+        unordered_map<u64, u64> m_code_pages;
+
+        // warm resets keep translations of code pages whose contents did
+        // not change as well as the DMI pointers obtained from the env
+        bool m_warm_reset;
+
+        u64  code_page_hash(u64 page);
+        void warm_reset_verify();
+        void tb_flush_code_pages();
+
+        // hot guest code ranges from a previous run (param prefault), given
+        // as physical addresses; at creation and reset, when the MMU may
+        // still be off, the DMI pointers of their pages are looked
+        // up and the host memory behind them is faulted in, optionally on
+        // a background thread which is joined before the next step
+        std::vector<trace_range> m_prefault;
+        bool                     m_prefault_async;
+        std::thread              m_prefault_thread;
+
+        void      setup_prefault();
+        void      prefault();
+        void      prefault_join();
+        const u8* prefault_page(u64 page);
+
         size_t read_mem_virt(u64 addr, void* buf, size_t bufsz);
         size_t write_mem_virt(u64 addr, const void* buf, size_t bufsz);
         size_t access_mem_phys(u64 addr, u8* buf, size_t bufsz, bool iswr);
+        size_t access_mem_dmi(u64 addr, u8* buf, size_t bufsz, bool iswr);
+
+        // results of get_page_ptr_r/w per page, including refusals, kept
+        // until the env invalidates the page or the core is reset
+        struct dmi_entry {
+            u8* ptr[2]; // read, write
+            u8  known;  // bit 0: read queried, bit 1: write queried
+        };
+
+        unordered_map<u64, dmi_entry> m_dmi_cache;
+
+        // large regions granted by the env, keyed by their start address
+        struct dmi_region {
+            u64 end;
+            u8* ptr;
+        };
+
+        env_dmi_region_extension* m_dmi_region_ext;
+        map<u64, dmi_region>      m_dmi_regions[2]; // read, write
+
+        u8*    get_page_ptr(u64 page, bool iswr);
+        u8*    lookup_page_ptr(u64 page, bool iswr);
+        u8*    find_region_ptr(u64 page, bool iswr);
+        u8*    get_region_ptr(u64 page, bool iswr);
+        static void erase_regions(map<u64, dmi_region>& regions, u64 start,
+                                  u64 end);
+        void   dmi_cache_invalidate(u64 start, u64 end);
+
+        u8*    dmi_page_ptr(u64 page, bool iswr);
+
+        // dirty page tracking: write DMI is only granted for pages already
+        // marked dirty, so the first write to a clean page goes through
+        // helper_transport; such pages get their DMI mapping dropped at
+        // the end of the step to allow write DMI again
+        bool             m_dirty_on;
+        dirty_map        m_dirty;
+        std::vector<u64> m_dirty_new;
+
+        bool dirty_mark(u64 page);
+        void dirty_mark_range(u64 addr, u64 size);
+        void dirty_reprotect(const u64* pages, u64 count);
+        void dirty_flush();
+        size_t dmi_range_virt(u64 addr, size_t size, bool iswr, u8*& host);
+
+        // semihosting console output is buffered per core and written out
+        // on newline, when full, on exit and when the core is destroyed;
+        // stderr has a buffer of its own unless the console is redirected
+        // into a file, which then receives both
+        int          m_console_fd;
+        string       m_console_buf[2]; // console, stderr
+
+        void console_open();
+        void console_write(int fd, const void* data, size_t size);
+        void console_flush(int idx);
+        void console_flush();
 
         string semihosting_read_string(u64 addr, size_t n);
         u64    semihosting_read_reg(unsigned int no);
@@ -243,6 +792,7 @@ namespace ocx { namespace arm {
 
         static bool helper_dmi(void* arg, u64 addr, unsigned char** dmiptr,
                                int* prot);
+        bool lookup_dmi(u64 page, unsigned char** dmiptr, int* prot);
         static void helper_pgprot(void* arg, unsigned char* p, uint64_t addr);
 
         static uc_tx_result_t helper_transport(uc_engine* uc, void* cpu,
@@ -259,18 +809,19 @@ namespace ocx { namespace arm {
                                       bool iswr);
 
         static void helper_trace_bb(void* cpu, u64 pc);
+        static void helper_bbtrace(uc_engine* uc, u64 addr, u32 size,
+                                   void* cpu);
         static void helper_trace_insn(uc_engine* uc, u64 vaddr,
                                       u64 size, void* cpu);
+        static void helper_trace_insn_batch(uc_engine* uc, u64 vaddr,
+                                            u64 size, void* cpu);
+        static void helper_trace_insn_filtered(uc_engine* uc, u64 vaddr,
+                                               u64 size, void* cpu);
 
         static void helper_hint(void* opaque, uc_hint_t hint);
         static u64 helper_semihosting(void* opaque, u32 call);
 
         static const char* helper_config(void* opaque, const char* config);
-
-        struct flush_page_mmuidx_args {
-            u64 addr;
-            uint16_t idxmap;
-        };
     };
 
     core::core(env &env, const model* modl) :
@@ -286,7 +837,69 @@ namespace ocx { namespace arm {
         m_procid(0),
         m_coreid(0),
         m_trace_insns(dynamic_cast<ocx::env_trace_insns_extension*>(&m_env)),
-        m_trace_insns_hook(0) {
+        m_trace_insns_hooks(),
+        m_trace_batch(dynamic_cast<env_trace_insns_batch_extension*>(&m_env)),
+        m_trace_buf(),
+        m_trace_len(0),
+        m_trace_ranges(),
+        m_trace_el_mask(0),
+        m_trace_asid(-1),
+        m_bbtrace(),
+        m_bbtrace_hook(0),
+        m_trace_bb(false),
+        m_profile(),
+        m_profile_on(false),
+        m_profile_stacks(false),
+        m_profile_prev(),
+        m_timer_clock(),
+        m_local_ps_per_insn(0),
+        m_local_time_ps(0),
+        m_idle_skip(is_true(env.get_param("idle_skip"))),
+        m_idle(false),
+        m_irq_lines(0),
+        m_idle_start_ps(0),
+        m_idle_cycles(0),
+        m_timer_deadline(),
+        m_run_deadline_ps(UINT64_MAX),
+        m_in_step_until(false),
+        m_stop_reason(STOP_BUDGET),
+        m_poll_limit(0),
+        m_poll_head(0),
+        m_poll_iters(0),
+        m_poll_blocks(0),
+        m_poll_clean(false),
+        m_poll_hash(0),
+        m_poll_prev_hash(0),
+        m_poll_writes(),
+        m_perf(),
+        m_perf_timing(is_true(env.get_param("perf_counters"))),
+        m_tlb_defer(true),
+        m_tlb_all(false),
+        m_tlb_idxmap(0),
+        m_tlb_pages(),
+        m_tlb_pool(),
+        m_tlb_clean(TLB_ALL_MMUIDX),
+        m_reg_slot(),
+        m_slot_regid(),
+        m_slot_vals(),
+        m_slot_used(),
+        m_batch_ids(),
+        m_batch_vals(),
+        m_state(),
+        m_running(false),
+        m_code_pages(),
+        m_warm_reset(is_true(env.get_param("warm_reset"))),
+        m_prefault(),
+        m_prefault_async(false),
+        m_prefault_thread(),
+        m_dmi_cache(),
+        m_dmi_region_ext(dynamic_cast<env_dmi_region_extension*>(&m_env)),
+        m_dmi_regions(),
+        m_dirty_on(false),
+        m_dirty(),
+        m_dirty_new(),
+        m_console_fd(-1),
+        m_console_buf() {
         uc_err ret = uc_open(m_model->name, this, &helper_config, &m_uc);
         ERROR_ON(ret != UC_ERR_OK, "unicorn error: %s", uc_strerror(ret));
 
@@ -343,9 +956,99 @@ namespace ocx { namespace arm {
             cs_ret = cs_open(arch, mode, &m_cap_thumb);
             ERROR_ON(cs_ret != CS_ERR_OK, "error setup capstone disassembler");
         }
+
+        setup_reg_slots();
+
+        const char* defer = m_env.get_param("tlb_flush_defer");
+        if (defer != nullptr && *defer != '\0')
+            m_tlb_defer = is_true(defer);
+
+        setup_local_time();
+
+        std::fill(m_timer_deadline, m_timer_deadline + ARM_TIMER_NUM,
+                  UINT64_MAX);
+
+        const char* poll = m_env.get_param("poll_detect");
+        if (poll != nullptr && *poll != '\0')
+            m_poll_limit = strtoull(poll, nullptr, 0);
+        if (m_poll_limit) {
+            profile_detail(true);
+            setup_bb_trace();
+        }
+
+        setup_prefault();
+    }
+
+    void core::setup_local_time() {
+        const char* clock = m_env.get_param("local_time_clock");
+        if (clock == nullptr || *clock == '\0')
+            return;
+
+        const char* cpi = m_env.get_param("local_time_cpi");
+        double cycles = 1.0;
+        if (cpi != nullptr && *cpi != '\0')
+            cycles = strtod(cpi, nullptr);
+
+        u64 hz = strtoull(clock, nullptr, 0);
+        ERROR_ON(hz == 0 || !(cycles > 0.0), "invalid local time parameters");
+
+        m_local_ps_per_insn = (u64)(cycles * PS_PER_SEC / hz + 0.5);
+        ERROR_ON(m_local_ps_per_insn == 0, "local time clock too fast");
+    }
+
+    void core::idle_enter() {
+        m_perf[PERF_IDLE]++;
+        m_idle = true;
+        m_idle_start_ps = m_local_ps_per_insn ? m_local_time_ps +
+            m_local_ps_per_insn * uc_instruction_count(m_uc) : env_time_ps();
+    }
+
+    void core::idle_leave() {
+        if (!m_idle)
+            return;
+
+        m_idle = false;
+
+        u64 now = env_time_ps();
+        if (m_timer_clock.clock() == 0 || now <= m_idle_start_ps)
+            return;
+
+        bool overflow;
+        m_idle_cycles += m_timer_clock.ps_to_ticks(now, overflow) -
+                         m_timer_clock.ps_to_ticks(m_idle_start_ps, overflow);
+    }
+
+    u64 core::next_timer_deadline() const {
+        return *std::min_element(m_timer_deadline,
+                                 m_timer_deadline + ARM_TIMER_NUM);
+    }
+
+    bool core::idle(u64& deadline_ps) {
+        deadline_ps = next_timer_deadline();
+        return m_idle;
+    }
+
+    u64 core::idle_cycles() {
+        return m_idle_cycles;
+    }
+
+    u64 core::env_time_ps() {
+        m_perf[PERF_TIME]++;
+        perf_timer timer(this, PERF_TIME_NS);
+        return m_env.get_time_ps();
     }
 
     core::~core() {
+        prefault_join();
+
+        if (m_perf_timing)
+            dump_perf_counters();
+
+        branch_trace_stop();
+        console_flush();
+        if (m_console_fd > STDERR_FILENO)
+            close(m_console_fd);
+
         if (m_uc) {
             uc_close(m_uc);
             m_uc = nullptr;
@@ -406,13 +1109,43 @@ namespace ocx { namespace arm {
     }
 
     u64 core::step(u64 num_insn) {
+        prefault_join();
+
+        if (m_idle) {
+            m_stop_reason = STOP_IDLE;
+            if (!m_irq_lines)
+                return 0;
+            idle_leave();
+        }
+
+        m_stop_reason = STOP_BUDGET;
+        poll_reset(~0ull);
+
         u64 pc = get_program_counter();
 
         if (is_thumb())
             pc |= 1;
 
+        // never let the counter run backwards if the env advanced less
+        // than we did locally during the previous step
+        if (m_local_ps_per_insn)
+            m_local_time_ps = std::max(env_time_ps(), m_local_time_ps);
+
+        m_running = true;
+        invalidate_state();
+
         uc_err ret = uc_emu_start(m_uc, pc, ~0ull, 0, num_insn);
 
+        m_running = false;
+        state();
+
+        flush_trace_insns();
+        broadcast_tlb_flushes();
+        dirty_flush();
+
+        if (m_bbtrace_hook)
+            m_bbtrace->truncate(get_program_counter());
+
         switch (ret) {
         case UC_ERR_OK:
         case UC_ERR_YIELD:
@@ -431,13 +1164,82 @@ namespace ocx { namespace arm {
 
         u64 executed = uc_instruction_count(m_uc);
         m_num_insn += executed;
+        m_local_time_ps += executed * m_local_ps_per_insn;
+
+        // even fetching the first instruction may have filled the TLB,
+        // e.g. when stopping on a breakpoint there right away
+        m_tlb_clean = 0;
+
+        // rescheduling is internal to step_until, never report it
+        if (m_stop_reason == STOP_RESCHEDULE && !m_in_step_until)
+            m_stop_reason = STOP_BUDGET;
+
         return executed;
     }
 
     void core::stop() {
+        stop_for(STOP_REQUEST);
+    }
+
+    void core::stop_for(int reason) {
+        if (m_stop_reason == STOP_BUDGET)
+            m_stop_reason = reason;
         uc_emu_stop(m_uc);
     }
 
+    int core::stop_reason() {
+        return m_stop_reason;
+    }
+
+    u64 core::step_until(u64 target_ps, u64 num_insn) {
+        const u64 rate = m_local_ps_per_insn ? m_local_ps_per_insn
+                                             : DEFAULT_PS_PER_INSN;
+        const u64 limit = num_insn ? num_insn : UINT64_MAX;
+
+        u64 start_ps = env_time_ps();
+        if (m_local_ps_per_insn)
+            start_ps = max(start_ps, m_local_time_ps);
+
+        u64 total = 0;
+        while (total < limit) {
+            u64 now = start_ps + total * rate;
+            u64 timer = next_timer_deadline();
+            u64 deadline = min(target_ps, timer);
+            int reason = timer < target_ps ? STOP_TIMER : STOP_DEADLINE;
+
+            if (deadline <= now) {
+                m_stop_reason = reason;
+                break;
+            }
+
+            // round up so that the deadline is actually reached
+            u64 budget = (deadline - now) / rate;
+            if ((deadline - now) % rate)
+                budget++;
+
+            bool capped = budget >= limit - total;
+            if (capped)
+                budget = limit - total;
+
+            m_run_deadline_ps = deadline;
+            m_in_step_until = true;
+            total += step(budget);
+            m_in_step_until = false;
+            m_run_deadline_ps = UINT64_MAX;
+
+            if (m_stop_reason == STOP_RESCHEDULE) {
+                m_stop_reason = STOP_BUDGET;
+                continue;
+            }
+
+            if (m_stop_reason == STOP_BUDGET && !capped)
+                m_stop_reason = reason;
+            break;
+        }
+
+        return total;
+    }
+
     u64 core::insn_count() {
         return uc_instruction_count(m_uc);
     }
@@ -455,9 +1257,191 @@ namespace ocx { namespace arm {
         // actually reset cpu, PC gets set to RVBAR, which is why we updated
         // that above; this also resets EL, PSTATE, etc.
         uc_reset_cpu(m_uc);
+        invalidate_state();
+        m_idle = false;
+
+        if (m_warm_reset) {
+            warm_reset_verify();
+        } else {
+            // forget refusals, the env may have set up new memory by now
+            m_dmi_cache.clear();
+            m_dmi_regions[0].clear();
+            m_dmi_regions[1].clear();
+        }
 
         // restore (V-)MPIDR values
         set_id(m_procid, m_coreid);
+
+        prefault();
+    }
+
+    u64 core::code_page_hash(u64 page) {
+        const u8* ptr = get_page_ptr(page, false);
+        if (ptr == nullptr)
+            return 0;
+
+        u64 hash = 0xcbf29ce484222325ull;
+        for (u64 i = 0; i < PAGE_SIZE; i += sizeof(u64)) {
+            u64 word;
+            memcpy(&word, ptr + i, sizeof(word));
+            hash = (hash ^ word) * 0x100000001b3ull;
+        }
+
+        return hash ? hash : 1; // zero means unknown
+    }
+
+    void core::warm_reset_verify() {
+        // the env reports memory changes through invalidate_page_ptr(s),
+        // but images are often reloaded behind our back, so check what
+        // the code pages hold now against what got translated
+        std::vector<u64> stale;
+        for (const auto& it : m_code_pages)
+            if (it.second == 0 || code_page_hash(it.first) != it.second)
+                stale.push_back(it.first);
+
+        if (stale.size() > TB_FLUSH_MAX_PAGES) {
+            tb_flush();
+            return;
+        }
+
+        for (u64 page : stale)
+            tb_flush_page(page, page + PAGE_SIZE - 1);
+    }
+
+    // parses addresses and inclusive "start-end" ranges separated by commas
+    // or whitespace; with a leading '@', they are read from the file named
+    // by the rest of text, where '#' starts a comment
+    static bool parse_ranges(const char* text,
+                             std::vector<trace_range>& ranges) {
+        string buf;
+        if (*text == '@') {
+            FILE* file = fopen(text + 1, "r");
+            if (file == nullptr)
+                return false;
+
+            char chunk[4096];
+            size_t n;
+            while ((n = fread(chunk, 1, sizeof(chunk), file)) > 0)
+                buf.append(chunk, n);
+            fclose(file);
+            text = buf.c_str();
+        }
+
+        const char* pos = text;
+        while (*pos != '\0') {
+            if (*pos == '#') {
+                while (*pos != '\0' && *pos != '\n')
+                    pos++;
+                continue;
+            }
+
+            if (*pos == ',' || isspace((unsigned char)*pos)) {
+                pos++;
+                continue;
+            }
+
+            char* end;
+            u64 start = strtoull(pos, &end, 0);
+            if (end == pos)
+                return false;
+
+            u64 last = start;
+            if (*end == '-') {
+                pos = end + 1;
+                last = strtoull(pos, &end, 0);
+                if (end == pos || last < start)
+                    return false;
+            }
+
+            ranges.push_back({ start, last });
+            pos = end;
+        }
+
+        return true;
+    }
+
+    static void prefault_touch(std::vector<const u8*> pages) {
+        // one read per cache line faults the page in and leaves as much of
+        // it in the host caches as fits
+        u8 sum = 0;
+        for (const u8* page : pages)
+            for (u64 i = 0; i < PAGE_SIZE; i += PREFAULT_STRIDE)
+                sum += *(const volatile u8*)(page + i);
+        (void)sum;
+    }
+
+    void core::setup_prefault() {
+        const char* ranges = m_env.get_param("prefault");
+        if (ranges == nullptr || *ranges == '\0')
+            return;
+
+        ERROR_ON(!parse_ranges(ranges, m_prefault),
+                 "invalid prefault ranges: %s", ranges);
+        m_prefault_async = is_true(m_env.get_param("prefault_async"));
+        prefault();
+    }
+
+    const u8* core::prefault_page(u64 page) {
+        const u8* ptr = get_page_ptr(page, false);
+        if (ptr != nullptr)
+            return ptr;
+
+        // the env may still be setting up memory, so do not let the
+        // refusal stick until the page would first be fetched from
+        auto it = m_dmi_cache.find(page);
+        if (it != m_dmi_cache.end() && (it->second.known &= ~1) == 0)
+            m_dmi_cache.erase(it);
+        return nullptr;
+    }
+
+    void core::prefault() {
+        prefault_join();
+        if (m_prefault.empty())
+            return;
+
+        // unicorn only translates blocks when executing them, so prepare
+        // what translating them needs instead: DMI pointers are looked up
+        // now rather than on first fetch, and the host memory behind them
+        // is faulted in before the first step
+        std::vector<const u8*> pages;
+        u64 budget = PREFAULT_MAX_PAGES;
+        for (const trace_range& r : m_prefault) {
+            const u64 last = r.end & ~(PAGE_SIZE - 1);
+            u64 missing = 0;
+            for (u64 addr = r.start & ~(PAGE_SIZE - 1); budget > 0;
+                 addr += PAGE_SIZE) {
+                budget--;
+                const u8* ptr = prefault_page(addr);
+                if (ptr != nullptr)
+                    pages.push_back(ptr);
+                else
+                    missing++;
+                if (addr == last)
+                    break;
+            }
+
+            if (missing) {
+                INFO("prefault: %" PRIu64 " pages of 0x%" PRIx64 "-0x%"
+                     PRIx64 " have no DMI", missing, r.start, r.end);
+            }
+        }
+
+        if (budget == 0)
+            INFO("prefault: stopped after %" PRIu64 " pages",
+                 PREFAULT_MAX_PAGES);
+
+        std::sort(pages.begin(), pages.end());
+        pages.erase(std::unique(pages.begin(), pages.end()), pages.end());
+
+        if (m_prefault_async)
+            m_prefault_thread = std::thread(prefault_touch, move(pages));
+        else
+            prefault_touch(move(pages));
+    }
+
+    void core::prefault_join() {
+        if (m_prefault_thread.joinable())
+            m_prefault_thread.join();
     }
 
     void core::interrupt(u64 irq, bool set) {
@@ -465,12 +1449,21 @@ namespace ocx { namespace arm {
             return;
         uc_err ret = uc_interrupt(m_uc, IRQMAP[irq], set);
         ERROR_ON(ret != UC_ERR_OK, "error dispatching irq %" PRIu64, irq);
+
+        if (set) {
+            m_irq_lines |= 1ull << irq;
+            idle_leave();
+        } else {
+            m_irq_lines &= ~(1ull << irq);
+        }
     }
 
     void core::notified(u64 eventid) {
         static_assert(ARM_TIMER_PHYS == 0, "unexpected ARM_TIMER_PHYS value");
         if (eventid > ARM_TIMER_SEC)
             ERROR("invalid timer index %" PRIu64, eventid);
+        m_timer_deadline[eventid] = UINT64_MAX;
+        idle_leave();
         uc_err ret = uc_update_timer(m_uc, (int)eventid);
         ERROR_ON(ret != UC_ERR_OK, "timer update: %s", uc_strerror(ret));
     }
@@ -534,6 +1527,8 @@ namespace ocx { namespace arm {
             return uc_reg_write(m_uc, r.id, buf) == UC_ERR_OK;
         }
 
+        invalidate_state();
+
         u64 oldval = 0ull;
         if (uc_reg_read(m_uc, r.id, &oldval) != UC_ERR_OK)
             return false;
@@ -550,88 +1545,1185 @@ namespace ocx { namespace arm {
         return true;
     }
 
-    bool core::add_breakpoint(u64 addr) {
-        uc_err ret = uc_cbbreakpoint_insert(m_uc, addr);
-        return ret == UC_ERR_OK;
+    void core::setup_reg_slots() {
+        m_reg_slot.assign(m_model->nregs, -1);
+        m_slot_regid.clear();
+
+        for (unsigned int idx = 0; idx < m_model->nregs; idx++) {
+            const reg& r = m_model->registers[idx];
+            if (reg_size(idx) > sizeof(u64))
+                continue;
+
+            auto it = std::find(m_slot_regid.begin(), m_slot_regid.end(), r.id);
+            m_reg_slot[idx] = (int)(it - m_slot_regid.begin());
+            if (it == m_slot_regid.end())
+                m_slot_regid.push_back(r.id);
+        }
+
+        m_slot_vals.assign(m_slot_regid.size(), 0);
+        m_slot_used.assign(m_slot_regid.size(), 0);
     }
 
-    bool core::remove_breakpoint(u64 addr) {
-        uc_err ret = uc_cbbreakpoint_remove(m_uc, addr);
-        return ret == UC_ERR_OK;
+    bool core::collect_reg_slots(const u64* regids, u64 count) {
+        m_batch_ids.clear();
+        m_batch_vals.clear();
+        std::fill(m_slot_used.begin(), m_slot_used.end(), 0);
+
+        for (u64 i = 0; i < count; i++) {
+            const u64 idx = regids ? regids[i] : i;
+            const reg& r = m_model->registers[idx];
+            const u64 size = reg_size(idx);
+
+            if (size > sizeof(u64)) {
+                // vector registers are transferred straight from/to the
+                // caller buffer and do not take part in the slot batch
+                ERROR_ON(r.offset, "cannot handle offsets with vector registers");
+                continue;
+            }
+
+            const int slot = m_reg_slot[idx];
+            if (!m_slot_used[slot]) {
+                m_slot_used[slot] = 1;
+                m_slot_vals[slot] = 0;
+                m_batch_ids.push_back(m_slot_regid[slot]);
+                m_batch_vals.push_back(&m_slot_vals[slot]);
+            }
+        }
+
+        if (m_batch_ids.empty())
+            return true;
+
+        return uc_reg_read_batch(m_uc, m_batch_ids.data(), m_batch_vals.data(),
+                                 (int)m_batch_ids.size()) == UC_ERR_OK;
     }
 
-    bool core::add_watchpoint(u64 addr, u64 size, bool iswr) {
-        int rw = iswr ? UC_WP_WRITE : UC_WP_READ;
-        uc_err ret = uc_cbwatchpoint_insert(m_uc, addr, size, rw);
-        return ret == UC_ERR_OK;
+    u64 core::regs_size(const u64* regids, u64 count) {
+        u64 total = 0;
+        for (u64 i = 0; i < count; i++)
+            total += reg_size(regids ? regids[i] : i);
+        return total;
+    }
+
+    bool core::read_regs(const u64* regids, u64 count, void* buf) {
+        // fetch every underlying scalar register once
+        if (!collect_reg_slots(regids, count))
+            return false;
+
+        // vector registers go into buf directly in a second batch
+        m_batch_ids.clear();
+        m_batch_vals.clear();
+
+        u8* out = (u8*)buf;
+        for (u64 i = 0; i < count; i++) {
+            const u64 idx = regids ? regids[i] : i;
+            const reg& r = m_model->registers[idx];
+            const u64 size = reg_size(idx);
+
+            if (size > sizeof(u64)) {
+                m_batch_ids.push_back(r.id);
+                m_batch_vals.push_back(out);
+            } else {
+                const u64 mask = gen_mask(r.width);
+                u64 buffer = (m_slot_vals[m_reg_slot[idx]] >> r.offset) & mask;
+                memcpy(out, &buffer, size);
+            }
+
+            out += size;
+        }
+
+        if (m_batch_ids.empty())
+            return true;
+
+        return uc_reg_read_batch(m_uc, m_batch_ids.data(), m_batch_vals.data(),
+                                 (int)m_batch_ids.size()) == UC_ERR_OK;
+    }
+
+    bool core::write_regs(const u64* regids, u64 count, const void* buf) {
+        // read old values of all affected scalar registers once, so that
+        // bitfield writes can be merged into them
+        if (!collect_reg_slots(regids, count))
+            return false;
+
+        invalidate_state();
+
+        const u8* in = (const u8*)buf;
+        for (u64 i = 0; i < count; i++) {
+            const u64 idx = regids ? regids[i] : i;
+            const reg& r = m_model->registers[idx];
+            const u64 size = reg_size(idx);
+
+            if (size > sizeof(u64)) {
+                m_batch_ids.push_back(r.id);
+                m_batch_vals.push_back((void*)in);
+            } else {
+                const u64 mask = gen_mask(r.width);
+                u64& val = m_slot_vals[m_reg_slot[idx]];
+                u64 newval = 0ull;
+                memcpy(&newval, in, size);
+                val = ((newval & mask) << r.offset) | (val & ~(mask << r.offset));
+            }
+
+            in += size;
+        }
+
+        if (m_batch_ids.empty())
+            return true;
+
+        return uc_reg_write_batch(m_uc, m_batch_ids.data(), m_batch_vals.data(),
+                                  (int)m_batch_ids.size()) == UC_ERR_OK;
+    }
+
+    bool core::checkpoint_regs(std::vector<u8>& buf) {
+        // every underlying unicorn register once, bitfield aliases of the
+        // register database are covered by their parent register
+        std::vector<void*> vals;
+        for (u64& val : m_slot_vals)
+            vals.push_back(&val);
+
+        if (!m_slot_regid.empty() &&
+            uc_reg_read_batch(m_uc, m_slot_regid.data(), vals.data(),
+                              (int)m_slot_regid.size()) != UC_ERR_OK)
+            return false;
+
+        for (size_t i = 0; i < m_slot_regid.size(); i++) {
+            put_raw(buf, (u32)m_slot_regid[i]);
+            put_raw(buf, (u32)sizeof(u64));
+            put_raw(buf, m_slot_vals[i]);
+        }
+
+        std::vector<u8> vec;
+        for (u64 idx = 0; idx < num_regs(); idx++) {
+            const u64 size = reg_size(idx);
+            if (size <= sizeof(u64))
+                continue;
+
+            vec.assign(size, 0);
+            if (uc_reg_read(m_uc, m_model->registers[idx].id, vec.data())
+                != UC_ERR_OK)
+                return false;
+
+            put_raw(buf, (u32)m_model->registers[idx].id);
+            put_raw(buf, (u32)size);
+            buf.insert(buf.end(), vec.begin(), vec.end());
+        }
+
+        return true;
+    }
+
+    bool core::restore_regs(const u8* data, size_t size) {
+        // some registers are banked on the current mode or EL, so write
+        // everything twice to not depend on the order of the registers
+        for (int pass = 0; pass < 2; pass++) {
+            const u8* pos = data;
+            const u8* end = data + size;
+            while (pos < end) {
+                u32 id, len;
+                if (!get_raw(pos, end, id) || !get_raw(pos, end, len) ||
+                    (size_t)(end - pos) < len)
+                    return false;
+
+                const u8* val = pos;
+                pos += len;
+
+                if (len > sizeof(u64)) {
+                    if (uc_reg_write(m_uc, (int)id, val) != UC_ERR_OK)
+                        return false;
+                    continue;
+                }
+
+                // skip unchanged values, which also keeps read-only ID
+                // registers from failing the restore
+                u64 newval = 0, oldval = 0;
+                memcpy(&newval, val, len);
+                if (uc_reg_read(m_uc, (int)id, &oldval) != UC_ERR_OK)
+                    return false;
+                if (oldval == newval)
+                    continue;
+                if (uc_reg_write(m_uc, (int)id, &newval) != UC_ERR_OK)
+                    return false;
+            }
+        }
+
+        return true;
+    }
+
+    bool core::checkpoint_save(int fd) {
+        std::vector<u8> buf(CKPT_MAGIC, CKPT_MAGIC + sizeof(CKPT_MAGIC));
+        buf.push_back(CKPT_VERSION);
+
+        std::vector<u8> payload(m_model->name,
+                                m_model->name + strlen(m_model->name));
+        put_section(buf, CKPT_MODEL, payload);
+
+        payload.clear();
+        if (!checkpoint_regs(payload))
+            return false;
+        put_section(buf, CKPT_REGS, payload);
+
+        payload.clear();
+        put_raw(payload, m_num_insn);
+        put_raw(payload, m_local_time_ps);
+        put_raw(payload, (u8)m_idle);
+        put_raw(payload, (u8)uc_is_excl(m_uc));
+        put_section(buf, CKPT_CORE, payload);
+
+        payload.clear();
+        put_raw(payload, m_timer_clock.clock());
+        for (int idx = ARM_TIMER_PHYS; idx < ARM_TIMER_NUM; idx++)
+            put_raw(payload, m_timer_deadline[idx]);
+        put_section(buf, CKPT_TIMER, payload);
+
+        payload.clear();
+        put_section(buf, CKPT_END, payload);
+
+        return write_all(fd, buf.data(), buf.size());
+    }
+
+    bool core::checkpoint_restore(int fd) {
+        u8 header[sizeof(CKPT_MAGIC) + 1];
+        if (!read_all(fd, header, sizeof(header)))
+            return false;
+
+        if (memcmp(header, CKPT_MAGIC, sizeof(CKPT_MAGIC)) != 0 ||
+            header[sizeof(CKPT_MAGIC)] != CKPT_VERSION)
+            return false;
+
+        bool model = false;
+        std::vector<u8> payload;
+        for (;;) {
+            u32 tag;
+            u64 size;
+            if (!read_all(fd, &tag, sizeof(tag)) ||
+                !read_all(fd, &size, sizeof(size)))
+                return false;
+
+            if (tag == CKPT_END)
+                break;
+
+            payload.resize(size);
+            if (size && !read_all(fd, payload.data(), size))
+                return false;
+
+            const u8* pos = payload.data();
+            const u8* end = pos + size;
+
+            switch (tag) {
+            case CKPT_MODEL:
+                if (size != strlen(m_model->name) ||
+                    memcmp(pos, m_model->name, size) != 0) {
+                    INFO("checkpoint was taken from a different model");
+                    return false;
+                }
+
+                model = true;
+                break;
+
+            case CKPT_REGS:
+                if (!model || !restore_regs(pos, size))
+                    return false;
+
+                // the image holds the (V-)MPIDR values of the saved core
+                set_id(m_procid, m_coreid);
+                break;
+
+            case CKPT_CORE: {
+                u8 idle = 0, excl = 0;
+                if (!get_raw(pos, end, m_num_insn) ||
+                    !get_raw(pos, end, m_local_time_ps) ||
+                    !get_raw(pos, end, idle) || !get_raw(pos, end, excl))
+                    return false;
+
+                // there is no way to re-arm the monitor, but clearing it
+                // is always allowed and only makes a pending STREX fail
+                m_idle = idle;
+                uc_clear_excl(m_uc);
+                break;
+            }
+
+            case CKPT_TIMER: {
+                u64 clock = 0;
+                if (!get_raw(pos, end, clock))
+                    return false;
+                for (int idx = ARM_TIMER_PHYS; idx < ARM_TIMER_NUM; idx++)
+                    if (!get_raw(pos, end, m_timer_deadline[idx]))
+                        return false;
+
+                if (clock && clock != m_timer_clock.clock())
+                    m_timer_clock.setup(clock);
+                break;
+            }
+
+            default:
+                break;
+            }
+        }
+
+        if (!model)
+            return false;
+
+        // translation state derived from system registers and memory
+        // restored by the env may have changed underneath
+        invalidate_state();
+        uc_err ret = uc_tlb_flush(m_uc);
+        ERROR_ON(ret != UC_ERR_OK, "failed to flush TLB");
+        m_tlb_clean = 0;
+        tb_flush();
+
+        // reschedule the generic timers from the restored registers; the
+        // env only hears about timers unicorn reschedules, so tell it
+        // about every deadline once more
+        for (int idx = ARM_TIMER_PHYS; idx < ARM_TIMER_NUM; idx++) {
+            ret = uc_update_timer(m_uc, idx);
+            ERROR_ON(ret != UC_ERR_OK, "timer update: %s", uc_strerror(ret));
+
+            if (m_timer_deadline[idx] == UINT64_MAX)
+                m_env.cancel(idx);
+            else
+                m_env.notify(idx, m_timer_deadline[idx]);
+        }
+
+        return true;
+    }
+
+    bool core::add_breakpoint(u64 addr) {
+        uc_err ret = uc_cbbreakpoint_insert(m_uc, addr);
+        return ret == UC_ERR_OK;
+    }
+
+    bool core::remove_breakpoint(u64 addr) {
+        uc_err ret = uc_cbbreakpoint_remove(m_uc, addr);
+        return ret == UC_ERR_OK;
+    }
+
+    bool core::add_watchpoint(u64 addr, u64 size, bool iswr) {
+        int rw = iswr ? UC_WP_WRITE : UC_WP_READ;
+        uc_err ret = uc_cbwatchpoint_insert(m_uc, addr, size, rw);
+        return ret == UC_ERR_OK;
+    }
+
+    bool core::remove_watchpoint(u64 addr, u64 size, bool iswr) {
+        int rw = iswr ? UC_WP_WRITE : UC_WP_READ;
+        uc_err ret = uc_cbwatchpoint_remove(m_uc, addr, size, rw);
+        return ret == UC_ERR_OK;
+    }
+
+    bool core::trace_basic_blocks(bool on) {
+        m_trace_bb = on;
+        return setup_bb_trace();
+    }
+
+    bool core::setup_bb_trace() {
+        bool on = m_trace_bb || m_profile_on || m_poll_limit;
+        uc_trace_basic_block_t func = on ? helper_trace_bb : NULL;
+        return uc_setup_basic_block_trace(m_uc, this, func);
+    }
+
+    bool core::profile_start(bool callstacks) {
+        if (m_profile == nullptr)
+            m_profile.reset(new bbprofile());
+
+        profile_detail(callstacks);
+
+        m_profile_on = true;
+        m_profile_stacks = callstacks;
+        m_profile_prev = bbprofile_entry();
+        return setup_bb_trace();
+    }
+
+    void core::profile_stop() {
+        if (!m_profile_on)
+            return;
+
+        m_profile_on = false;
+        setup_bb_trace();
+        profile_detail(false);
+    }
+
+    void core::profile_reset() {
+        if (m_profile)
+            m_profile->clear();
+        m_profile_prev = bbprofile_entry();
+    }
+
+    bool core::profile_dump(int fd, u64 limit) {
+        if (m_profile == nullptr)
+            return false;
+
+        std::vector<bbprofile_entry> entries;
+        m_profile->sorted(entries);
+        if (limit && entries.size() > limit)
+            entries.resize(limit);
+
+        const double total = (double)max<u64>(m_profile->total(), 1);
+
+        char line[512], insn[256];
+        snprintf(line, sizeof(line), "%16s %7s  %-18s %s\n", "count", "%",
+                 "address", "instruction");
+        if (!write_all(fd, line, strlen(line)))
+            return false;
+
+        for (const bbprofile_entry& e : entries) {
+            if (disassemble(e.pc, insn, sizeof(insn)) == 0)
+                snprintf(insn, sizeof(insn), "??");
+
+            snprintf(line, sizeof(line), "%16" PRIu64 " %6.2f%%  0x%016" PRIx64
+                     " %s\n", e.count, 100.0 * e.count / total, e.pc, insn);
+            if (!write_all(fd, line, strlen(line)))
+                return false;
+        }
+
+        return true;
+    }
+
+    bool core::profile_dump_folded(int fd) {
+        if (m_profile == nullptr)
+            return false;
+
+        string text;
+        m_profile->folded(text);
+        return write_all(fd, text.data(), text.size());
+    }
+
+    u64 core::num_perf_counters() {
+        return PERF_NUM;
+    }
+
+    const char* core::perf_counter_name(u64 idx) {
+        ERROR_ON(idx >= PERF_NUM, "counter index %" PRIu64 " out of bounds", idx);
+        return PERF_NAMES[idx];
+    }
+
+    u64 core::perf_counter(u64 idx) {
+        ERROR_ON(idx >= PERF_NUM, "counter index %" PRIu64 " out of bounds", idx);
+        return m_perf[idx];
+    }
+
+    void core::reset_perf_counters() {
+        memset(m_perf, 0, sizeof(m_perf));
+    }
+
+    void core::dump_perf_counters() {
+        fprintf(stderr, "%s core %" PRIu64 ".%" PRIu64 " performance counters:\n",
+                m_model->name, m_procid, m_coreid);
+        for (int i = 0; i < PERF_NUM; i++)
+            fprintf(stderr, "  %-24s %20" PRIu64 "\n", PERF_NAMES[i], m_perf[i]);
+    }
+
+    void core::profile_detail(bool on) {
+        // instruction groups are only available with details switched on,
+        // which the polling loop detector needs as well
+        const size_t value = on || m_poll_limit ? CS_OPT_ON : CS_OPT_OFF;
+        if (m_cap_aarch64)
+            cs_option(m_cap_aarch64, CS_OPT_DETAIL, value);
+        if (m_cap_aarch32)
+            cs_option(m_cap_aarch32, CS_OPT_DETAIL, value);
+        if (m_cap_thumb)
+            cs_option(m_cap_thumb, CS_OPT_DETAIL, value);
+    }
+
+    static u32 classify_branch(csh disas, const cs_insn& insn) {
+        if (cs_insn_group(disas, &insn, CS_GRP_CALL))
+            return BBPROFILE_CALL;
+        if (cs_insn_group(disas, &insn, CS_GRP_RET))
+            return BBPROFILE_RET;
+
+        // aarch32 returns are often just ordinary branches or loads
+        if (strcmp(insn.mnemonic, "bx") == 0 && strcmp(insn.op_str, "lr") == 0)
+            return BBPROFILE_RET;
+        if ((strncmp(insn.mnemonic, "pop", 3) == 0 ||
+             strncmp(insn.mnemonic, "ldm", 3) == 0) && strstr(insn.op_str, "pc"))
+            return BBPROFILE_RET;
+
+        if (cs_insn_group(disas, &insn, CS_GRP_JUMP) ||
+            cs_insn_group(disas, &insn, CS_GRP_INT) ||
+            cs_insn_group(disas, &insn, CS_GRP_IRET))
+            return BBPROFILE_OTHER;
+
+        return BBPROFILE_UNKNOWN;
+    }
+
+    void core::profile_classify(bbprofile_entry& e) {
+        // find the instruction ending the block by decoding ahead
+        u8 code[256];
+        size_t size = read_mem_virt(e.pc, code, sizeof(code));
+
+        e.kind = BBPROFILE_OTHER;
+        e.term = e.pc + size;
+
+        csh disas = lookup_disassembler();
+        if (!disas || size == 0)
+            return;
+
+        cs_insn* insn = nullptr;
+        size_t count = cs_disasm(disas, code, size, e.pc, 0, &insn);
+        for (size_t i = 0; i < count; i++) {
+            u32 kind = classify_branch(disas, insn[i]);
+            if (kind != BBPROFILE_UNKNOWN) {
+                e.kind = kind;
+                e.term = insn[i].address + insn[i].size;
+                break;
+            }
+        }
+
+        if (count)
+            cs_free(insn, count);
+    }
+
+    static bool may_write_memory(const cs_insn& insn) {
+        // stores (incl. exclusive, pair and vector forms), atomics, pushes
+        const char* m = insn.mnemonic;
+        if (strncmp(m, "st", 2) == 0 || strncmp(m, "vst", 3) == 0 ||
+            strncmp(m, "push", 4) == 0 || strncmp(m, "vpush", 5) == 0 ||
+            strncmp(m, "swp", 3) == 0 || strncmp(m, "cas", 3) == 0)
+            return true;
+
+        static const char* const ATOMICS[] = {
+            "ldadd", "ldclr", "ldeor", "ldset",
+            "ldsmax", "ldsmin", "ldumax", "ldumin",
+        };
+
+        for (const char* op : ATOMICS)
+            if (strncmp(m, op, strlen(op)) == 0)
+                return true;
+
+        // anything else with side effects: cache maintenance (dc zva),
+        // system register writes and exceptions
+        static const char* const SIDE_EFFECTS[] = {
+            "dc", "msr", "mcr", "sys", "svc", "hvc", "smc", "hlt", "brk",
+            "bkpt", "udf",
+        };
+
+        for (const char* op : SIDE_EFFECTS)
+            if (strncmp(m, op, strlen(op)) == 0)
+                return true;
+
+        return false;
+    }
+
+    bool core::poll_block_writes(u64 pc) {
+        auto it = m_poll_writes.find(pc);
+        if (it != m_poll_writes.end())
+            return it->second;
+
+        u8 code[256];
+        size_t size = read_mem_virt(pc, code, sizeof(code));
+
+        bool writes = true;
+        csh disas = lookup_disassembler();
+        cs_insn* insn = nullptr;
+        size_t count = 0;
+        if (disas && size)
+            count = cs_disasm(disas, code, size, pc, 0, &insn);
+
+        for (size_t i = 0; i < count; i++) {
+            writes = may_write_memory(insn[i]);
+            if (writes || classify_branch(disas, insn[i]) != BBPROFILE_UNKNOWN)
+                break;
+        }
+
+        if (count)
+            cs_free(insn, count);
+
+        m_poll_writes[pc] = writes;
+        return writes;
+    }
+
+    void core::poll_reset(u64 head) {
+        m_poll_head = head;
+        m_poll_iters = 0;
+        m_poll_blocks = head == ~0ull ? POLL_MAX_BLOCKS : 0;
+        m_poll_clean = true;
+        m_poll_hash = 0;
+        m_poll_prev_hash = 0;
+    }
+
+    u64 core::poll_regs_hash(u64 hash) const {
+        const bool a64 = state().aarch64;
+        const int* ids = a64 ? POLL_REGS_A64 : POLL_REGS_A32;
+        const size_t count = a64 ? sizeof(POLL_REGS_A64) / sizeof(int)
+                                 : sizeof(POLL_REGS_A32) / sizeof(int);
+
+        u64 vals[sizeof(POLL_REGS_A64) / sizeof(int)] = {};
+        void* ptrs[sizeof(POLL_REGS_A64) / sizeof(int)];
+        for (size_t i = 0; i < count; i++)
+            ptrs[i] = &vals[i];
+
+        if (uc_reg_read_batch(m_uc, const_cast<int*>(ids), ptrs, (int)count)
+            != UC_ERR_OK)
+            ERROR("failed to read registers");
+
+        return fnv1a(hash, vals, count * sizeof(u64));
+    }
+
+    void core::poll_block(u64 pc) {
+        if (pc == m_poll_head) {
+            m_poll_hash = poll_regs_hash(m_poll_hash);
+            bool same = m_poll_iters == 0 || m_poll_hash == m_poll_prev_hash;
+            m_poll_iters = m_poll_clean && same ? m_poll_iters + 1 : 0;
+            m_poll_prev_hash = m_poll_hash;
+            m_poll_hash = 0;
+            m_poll_clean = true;
+            m_poll_blocks = 0;
+
+            if (m_poll_iters >= m_poll_limit) {
+                m_perf[PERF_POLL]++;
+                m_poll_iters = 0;
+                stop_for(STOP_POLLING);
+            }
+        } else if (++m_poll_blocks > POLL_MAX_BLOCKS) {
+            poll_reset(pc);
+        }
+
+        if (m_poll_clean && poll_block_writes(pc))
+            m_poll_clean = false;
+    }
+
+    void core::profile_block(u64 pc) {
+        bbprofile_entry* e = m_profile->record(pc);
+        if (!m_profile_stacks)
+            return;
+
+        if (e->kind == BBPROFILE_UNKNOWN)
+            profile_classify(*e);
+
+        const bbprofile_entry& prev = m_profile_prev;
+        m_profile->enter(pc, prev.pc, prev.kind, prev.term);
+        m_profile_prev = *e;
+    }
+
+    bool core::trace_insns_hook(void* func, u64 start, u64 end) {
+        if (m_trace_batch) {
+            m_trace_buf.resize(TRACE_BATCH_SIZE);
+            m_trace_len = 0;
+        }
+
+        uc_hook hook = 0;
+        uc_err ret = uc_hook_add(m_uc, &hook, UC_HOOK_CODE, func, this,
+                                 start, end);
+        if (ret != UC_ERR_OK)
+            return false;
+
+        m_trace_insns_hooks.push_back(hook);
+        return true;
+    }
+
+    bool core::trace_insns_remove() {
+        if (m_trace_insns_hooks.empty())
+            return false;
+
+        flush_trace_insns();
+
+        for (uc_hook hook : m_trace_insns_hooks) {
+            uc_err ret = uc_hook_del(m_uc, hook);
+            ERROR_ON(ret != UC_ERR_OK, "failed to remove trace hook");
+        }
+
+        m_trace_insns_hooks.clear();
+        m_trace_ranges.clear();
+        m_trace_el_mask = 0;
+        m_trace_asid = -1;
+        return true;
+    }
+
+    void core::trace_insns_off() {
+        // tracing starts with a tb_flush, so every instrumented block sits
+        // on a page that got protected since then
+        if (trace_insns_remove())
+            tb_flush_code_pages();
+    }
+
+    void core::tb_flush_code_pages() {
+        if (m_code_pages.size() > TB_FLUSH_MAX_PAGES) {
+            tb_flush();
+            return;
+        }
+
+        // tb_flush_page drops the pages from m_code_pages
+        std::vector<u64> pages;
+        for (const auto& it : m_code_pages)
+            pages.push_back(it.first);
+
+        for (u64 page : pages)
+            tb_flush_page(page, page + PAGE_SIZE - 1);
+    }
+
+    bool core::trace_insns(bool on) {
+        if (m_trace_insns == nullptr && m_trace_batch == nullptr)
+            return false;
+
+        if (!on) {
+            trace_insns_off();
+            return true;
+        }
+
+        if (!m_trace_insns_hooks.empty() && m_trace_ranges.empty())
+            return true;
+
+        trace_insns_remove();
+        tb_flush();
+
+        void* func = m_trace_batch ? (void*)helper_trace_insn_batch
+                                   : (void*)helper_trace_insn;
+        return trace_insns_hook(func, 0, ~0);
+    }
+
+    bool core::trace_insns_filtered(const trace_range* ranges, u64 count,
+                                    u32 el_mask, i64 asid) {
+        if (m_trace_insns == nullptr && m_trace_batch == nullptr)
+            return false;
+
+        if (count == 0)
+            return false;
+
+        // translations are keyed by physical address, and a virtual range
+        // may map to different pages in every address space, so there is
+        // no telling which existing blocks need instrumenting
+        trace_insns_remove();
+        tb_flush();
+
+        m_trace_el_mask = el_mask;
+        m_trace_asid = asid;
+
+        void* func = (void*)helper_trace_insn_filtered;
+        if (!el_mask && asid < 0) {
+            func = m_trace_batch ? (void*)helper_trace_insn_batch
+                                 : (void*)helper_trace_insn;
+        }
+
+        // unicorn only instruments blocks inside a hook's range, so there
+        // is one hook per range
+        for (u64 i = 0; i < count; i++) {
+            m_trace_ranges.push_back(ranges[i]);
+            if (!trace_insns_hook(func, ranges[i].start, ranges[i].end)) {
+                trace_insns_off();
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    u64 core::current_asid() const {
+        if (!is_aarch64())
+            return 0;
+
+        u64 tcr = 0, ttbr = 0;
+        if (uc_reg_read(m_uc, UC_ARM64_REG_TCR_EL1, &tcr) != UC_ERR_OK)
+            ERROR("failed to read TCR_EL1");
+
+        // TCR_EL1.A1 selects which TTBR defines the ASID
+        int reg = (tcr >> 22) & 1 ? (int)UC_ARM64_REG_TTBR1_EL1
+                                  : (int)UC_ARM64_REG_TTBR0_EL1;
+        if (uc_reg_read(m_uc, reg, &ttbr) != UC_ERR_OK)
+            ERROR("failed to read TTBR");
+
+        // TCR_EL1.AS selects 16 bit ASIDs, otherwise only 8 bits are used
+        return (tcr >> 36) & 1 ? ttbr >> 48 : (ttbr >> 48) & 0xff;
+    }
+
+    bool core::branch_trace_start(int fd) {
+        branch_trace_stop();
+
+        tb_flush();
+        uc_err ret = uc_hook_add(m_uc, &m_bbtrace_hook, UC_HOOK_BLOCK,
+                                 (void*)helper_bbtrace, this, 0, ~0);
+        if (ret != UC_ERR_OK) {
+            m_bbtrace_hook = 0;
+            return false;
+        }
+
+        m_bbtrace.reset(new bbtrace_writer(fd));
+        return true;
+    }
+
+    void core::branch_trace_stop() {
+        if (!m_bbtrace_hook)
+            return;
+
+        uc_err ret = uc_hook_del(m_uc, m_bbtrace_hook);
+        ERROR_ON(ret != UC_ERR_OK, "failed to remove branch trace hook");
+        m_bbtrace_hook = 0;
+        tb_flush();
+
+        // keep the writer around so that its data can still be queried
+        m_bbtrace->finish();
+    }
+
+    const u8* core::branch_trace_data(u64& size) {
+        if (m_bbtrace == nullptr) {
+            size = 0;
+            return nullptr;
+        }
+
+        size = m_bbtrace->data().size();
+        return m_bbtrace->data().data();
+    }
+
+    bool core::branch_trace_decode(const u8* data, u64 size,
+                                   branch_trace_listener& l) {
+        bbtrace_parser parser(data, size);
+
+        bool synced = false;
+        int isa = BBTRACE_A64;
+        u64 addr = 0;
+
+        int kind;
+        u64 a, b;
+        while (parser.next(kind, a, b)) {
+            switch (kind) {
+            case BBTRACE_SYNC:
+                isa = (int)a;
+                addr = b;
+                synced = true;
+                break;
+
+            case BBTRACE_ISA:
+                isa = (int)a;
+                break;
+
+            case BBTRACE_RUN:
+            case BBTRACE_BRANCH:
+                if (!synced)
+                    return false;
+                branch_trace_run(addr, a, isa, l);
+                addr += a + b;
+                break;
+
+            default:
+                return false;
+            }
+        }
+
+        return parser.valid();
+    }
+
+    void core::branch_trace_run(u64 addr, u64 size, int isa,
+                                branch_trace_listener& l) {
+        csh disas = isa == BBTRACE_A64 ? m_cap_aarch64 :
+                    isa == BBTRACE_T32 ? m_cap_thumb : m_cap_aarch32;
+        ERROR_ON(!disas, "no disassembler available");
+
+        std::vector<u8> code(size);
+        size_t avail = read_mem_virt(addr, code.data(), size);
+
+        char text[256];
+        u64 offset = 0;
+        while (offset < size) {
+            cs_insn* insn = nullptr;
+            size_t count = 0;
+            if (offset < avail) {
+                count = cs_disasm(disas, code.data() + offset, avail - offset,
+                                  addr + offset, 0, &insn);
+            }
+
+            for (size_t i = 0; i < count && offset < size; i++) {
+                snprintf(text, sizeof(text), "%s %s", insn[i].mnemonic,
+                         insn[i].op_str);
+                l.handle_insn(insn[i].address, insn[i].size, text);
+                offset += insn[i].size;
+            }
+
+            if (count) {
+                cs_free(insn, count);
+                continue;
+            }
+
+            // unreadable or undecodable, skip a minimal instruction
+            u64 skip = std::min<u64>(isa == BBTRACE_T32 ? 2 : 4,
+                                     size - offset);
+            l.handle_insn(addr + offset, skip, ".data");
+            offset += skip;
+        }
+    }
+
+    int core::bbtrace_isa() const {
+        const exec_state& s = state();
+        if (s.aarch64)
+            return BBTRACE_A64;
+        return s.thumb ? BBTRACE_T32 : BBTRACE_A32;
+    }
+
+    bool core::bbtrace_exception(u64 addr, u64& ret) const {
+        // AArch64 vectors are 0x80 aligned entries of the 2 KiB table at
+        // VBAR_ELx of the EL the exception got taken to
+        if (addr & 0x7f)
+            return false;
+
+        const exec_state& s = state();
+        if (!s.aarch64 || s.el == 0)
+            return false;
+
+        static const int VBAR[] = {
+            UC_ARM64_REG_VBAR_EL1, UC_ARM64_REG_VBAR_EL2, UC_ARM64_REG_VBAR_EL3,
+        };
+
+        static const int ELR[] = {
+            UC_ARM64_REG_ELR_EL1, UC_ARM64_REG_ELR_EL2, UC_ARM64_REG_ELR_EL3,
+        };
+
+        u64 vbar = 0;
+        if (uc_reg_read(m_uc, VBAR[s.el - 1], &vbar) != UC_ERR_OK ||
+            addr - vbar >= 0x800)
+            return false;
+
+        return uc_reg_read(m_uc, ELR[s.el - 1], &ret) == UC_ERR_OK;
+    }
+
+    void core::flush_trace_insns() {
+        if (m_trace_len == 0)
+            return;
+
+        m_trace_batch->handle_trace_insns(m_trace_buf.data(), m_trace_len);
+        m_trace_len = 0;
+    }
+
+    bool core::virt_to_phys(u64 vaddr, u64& paddr) {
+        uc_err ret = uc_va2pa(m_uc, vaddr, (uint64_t *)&paddr);
+        return ret == UC_ERR_OK;
+    }
+
+    void core::handle_syscall(int callno, shared_ptr<void> arg) {
+        m_perf[PERF_SYSCALL]++;
+        switch (callno) {
+        case TLB_FLUSH:
+            remote_tlb_flush();
+            break;
+
+        case TLB_FLUSH_PAGE:
+            remote_tlb_flush_page(*(u64*)arg.get(), 0);
+            break;
+
+        case TLB_FLUSH_MMUIDX:
+            remote_tlb_flush_mmuidx(*(uint16_t*)arg.get());
+            break;
+
+        case TLB_FLUSH_PAGE_MMUIDX: {
+            flush_page_mmuidx_args* tmp = (flush_page_mmuidx_args*)(arg.get());
+            remote_tlb_flush_page(tmp->addr, tmp->idxmap);
+            break;
+        }
+
+        case TLB_FLUSH_BATCH: {
+            const flush_batch* batch = (const flush_batch*)arg.get();
+            if (batch->origin != this) // already flushed locally
+                apply_tlb_flush(*batch);
+            break;
+        }
+        default:
+            ERROR("unknown syscall id (%d)", callno);
+            break;
+        }
+    }
+
+    void core::remote_tlb_flush() {
+        if (m_tlb_clean == TLB_ALL_MMUIDX) {
+            m_perf[PERF_TLB_SKIPPED]++;
+            return;
+        }
+
+        uc_err ret;
+        if (m_tlb_clean) {
+            m_perf[PERF_TLB_NARROWED]++;
+            ret = uc_tlb_flush_mmuidx(m_uc, TLB_ALL_MMUIDX & ~m_tlb_clean);
+        } else {
+            ret = uc_tlb_flush(m_uc);
+        }
+
+        ERROR_ON(ret != UC_ERR_OK, "failed to flush TLB");
+        if (!m_running)
+            m_tlb_clean = TLB_ALL_MMUIDX;
+    }
+
+    void core::remote_tlb_flush_mmuidx(uint16_t idxmap) {
+        uint16_t dirty = idxmap & ~m_tlb_clean;
+        if (dirty == 0) {
+            m_perf[PERF_TLB_SKIPPED]++;
+            return;
+        }
+
+        if (dirty != idxmap)
+            m_perf[PERF_TLB_NARROWED]++;
+
+        uc_err ret = uc_tlb_flush_mmuidx(m_uc, dirty);
+        ERROR_ON(ret != UC_ERR_OK, "failed to flush TLB");
+        if (!m_running)
+            m_tlb_clean |= idxmap;
+    }
+
+    void core::remote_tlb_flush_page(u64 addr, uint16_t idxmap) {
+        // an idxmap of zero stands for all MMU indices
+        uint16_t mask = idxmap ? idxmap : TLB_ALL_MMUIDX;
+        uint16_t dirty = mask & ~m_tlb_clean;
+        if (dirty == 0) {
+            m_perf[PERF_TLB_SKIPPED]++;
+            return;
+        }
+
+        uc_err ret;
+        if (dirty != mask) {
+            m_perf[PERF_TLB_NARROWED]++;
+            ret = uc_tlb_flush_page_mmuidx(m_uc, addr, dirty);
+        } else if (idxmap) {
+            ret = uc_tlb_flush_page_mmuidx(m_uc, addr, idxmap);
+        } else {
+            ret = uc_tlb_flush_page(m_uc, addr);
+        }
+
+        ERROR_ON(ret != UC_ERR_OK, "failed to flush TLB entry");
+    }
+
+    bool core::dirty_mark(u64 page) {
+        return m_dirty.mark(page >> PAGE_BITS);
+    }
+
+    void core::dirty_mark_range(u64 addr, u64 size) {
+        // pages written without DMI get it granted again after the step
+        const u64 first = addr & ~(PAGE_SIZE - 1);
+        const u64 last = (addr + max<u64>(size, 1) - 1) & ~(PAGE_SIZE - 1);
+        for (u64 page = first; page <= last; page += PAGE_SIZE)
+            if (dirty_mark(page))
+                m_dirty_new.push_back(page);
+    }
+
+    void core::dirty_reprotect(const u64* pages, u64 count) {
+        // pages are sorted, drop the DMI mappings of contiguous runs
+        for (u64 i = 0; i < count;) {
+            u64 j = i + 1;
+            while (j < count && pages[j] == pages[j - 1] + PAGE_SIZE)
+                j++;
+
+            uc_err ret = uc_dmi_invalidate(m_uc, pages[i],
+                                           pages[j - 1] + PAGE_SIZE - 1);
+            ERROR_ON(ret != UC_ERR_OK, "failed to invalidate dmi ptr");
+            i = j;
+        }
+    }
+
+    void core::dirty_flush() {
+        if (m_dirty_new.empty())
+            return;
+
+        std::sort(m_dirty_new.begin(), m_dirty_new.end());
+        dirty_reprotect(m_dirty_new.data(), m_dirty_new.size());
+        m_dirty_new.clear();
     }
 
-    bool core::remove_watchpoint(u64 addr, u64 size, bool iswr) {
-        int rw = iswr ? UC_WP_WRITE : UC_WP_READ;
-        uc_err ret = uc_cbwatchpoint_remove(m_uc, addr, size, rw);
+    bool core::dirty_pages_track(bool on) {
+        m_dirty_on = on;
+        m_dirty.clear();
+        m_dirty_new.clear();
+
+        // start over with all mappings, write DMI has to be requested again
+        uc_err ret = uc_dmi_invalidate(m_uc, 0, ~0ull);
         return ret == UC_ERR_OK;
     }
 
-    bool core::trace_basic_blocks(bool on) {
-        uc_trace_basic_block_t func = on ? helper_trace_bb : NULL;
-        return uc_setup_basic_block_trace(m_uc, this, func);
+    u64 core::dirty_pages_fetch(u64* pages, u64 max) {
+        u64 count = m_dirty.fetch(pages, max);
+        for (u64 i = 0; i < count; i++)
+            pages[i] <<= PAGE_BITS;
+
+        dirty_reprotect(pages, count);
+        return count;
     }
 
-    bool core::trace_insns(bool on) {
-        if (m_trace_insns == nullptr)
-            return false;
+    u64 core::dirty_pages_fetch_bitmap(u64 start, u64 npages, u64* bitmap) {
+        const u64 first = start >> PAGE_BITS;
+        u64 count = m_dirty.fetch(first, npages, bitmap);
 
-        if (on) {
-            if (m_trace_insns_hook)
-                return true;
+        std::vector<u64> pages;
+        pages.reserve(count);
+        for (u64 i = 0; i < npages && pages.size() < count; i++)
+            if ((bitmap[i / 64] >> (i % 64)) & 1)
+                pages.push_back((first + i) << PAGE_BITS);
 
-            tb_flush();
-            uc_err ret = uc_hook_add(m_uc, &m_trace_insns_hook, UC_HOOK_CODE,
-                                     (void*)helper_trace_insn, this, 0, ~0);
-            return ret == UC_ERR_OK;
-        } else {
-            if (!m_trace_insns_hook)
-                return true;
+        dirty_reprotect(pages.data(), pages.size());
+        return count;
+    }
 
-            tb_flush();
-            uc_err ret = uc_hook_del(m_uc, m_trace_insns_hook);
-            return ret == UC_ERR_OK;
+    void core::apply_tlb_flush(const flush_batch& batch) {
+        if (m_tlb_clean == TLB_ALL_MMUIDX) {
+            m_perf[PERF_TLB_SKIPPED]++;
+            return;
+        }
+
+        if (batch.all) {
+            remote_tlb_flush();
+            return;
         }
+
+        if (batch.idxmap)
+            remote_tlb_flush_mmuidx(batch.idxmap);
+
+        for (const flush_range& r : batch.ranges)
+            for (u64 i = 0; i < r.pages; i++)
+                remote_tlb_flush_page(r.addr + i * PAGE_SIZE, r.idxmap);
     }
 
-    bool core::virt_to_phys(u64 vaddr, u64& paddr) {
-        uc_err ret = uc_va2pa(m_uc, vaddr, (uint64_t *)&paddr);
-        return ret == UC_ERR_OK;
+    void core::queue_tlb_flush_page(u64 addr, uint16_t idxmap) {
+        if (m_tlb_all)
+            return;
+
+        if (m_tlb_pages.size() >= TLB_FLUSH_MAX_PAGES) {
+            m_tlb_all = true;
+            m_tlb_pages.clear();
+            return;
+        }
+
+        m_tlb_pages.push_back({ addr & ~(PAGE_SIZE - 1), idxmap });
     }
 
-    void core::handle_syscall(int callno, shared_ptr<void> arg) {
-        uc_err ret;
-        switch (callno) {
-        case TLB_FLUSH:
-            ret = uc_tlb_flush(m_uc);
-            ERROR_ON(ret != UC_ERR_OK, "failed to flush TLB");
-            break;
+    shared_ptr<core::flush_batch> core::alloc_flush_batch() {
+        // batches are reused once all receivers have dropped them
+        for (const shared_ptr<flush_batch>& batch : m_tlb_pool)
+            if (batch.use_count() == 1)
+                return batch;
 
-        case TLB_FLUSH_PAGE:
-            ret = uc_tlb_flush_page(m_uc, *(u64*)arg.get());
-            ERROR_ON(ret != UC_ERR_OK, "failed to flush TLB entry");
-            break;
+        m_tlb_pool.push_back(std::make_shared<flush_batch>());
+        return m_tlb_pool.back();
+    }
 
-        case TLB_FLUSH_MMUIDX:
-            ret = uc_tlb_flush_mmuidx(m_uc, *(uint16_t*)arg.get());
-            ERROR_ON(ret != UC_ERR_OK, "failed to flush TLB");
-            break;
+    void core::broadcast_tlb_flushes() {
+        if (!m_tlb_all && !m_tlb_idxmap && m_tlb_pages.empty())
+            return;
 
-        case TLB_FLUSH_PAGE_MMUIDX: {
-            flush_page_mmuidx_args* tmp = (flush_page_mmuidx_args*)(arg.get());
-            ret = uc_tlb_flush_page_mmuidx(m_uc, tmp->addr, tmp->idxmap);
-            ERROR_ON(ret != UC_ERR_OK, "failed to flush TLB entry");
-            break;
-        }
-        default:
-            ERROR("unknown syscall id (%d)", callno);
-            break;
+        shared_ptr<flush_batch> batch = alloc_flush_batch();
+        batch->origin = this;
+        batch->all = m_tlb_all;
+        batch->idxmap = m_tlb_idxmap;
+        batch->ranges.clear();
+
+        if (!m_tlb_all) {
+            std::sort(m_tlb_pages.begin(), m_tlb_pages.end(),
+                      [](const flush_page_mmuidx_args& a,
+                         const flush_page_mmuidx_args& b) {
+                return a.idxmap != b.idxmap ? a.idxmap < b.idxmap
+                                            : a.addr < b.addr;
+            });
+
+            for (const flush_page_mmuidx_args& p : m_tlb_pages) {
+                if (!batch->ranges.empty()) {
+                    flush_range& last = batch->ranges.back();
+                    u64 end = last.addr + last.pages * PAGE_SIZE;
+                    if (last.idxmap == p.idxmap && p.addr < end)
+                        continue; // duplicate
+                    if (last.idxmap == p.idxmap && p.addr == end) {
+                        last.pages++;
+                        continue;
+                    }
+                }
+
+                batch->ranges.push_back({ p.addr, 1, p.idxmap });
+            }
         }
+
+        m_tlb_all = false;
+        m_tlb_idxmap = 0;
+        m_tlb_pages.clear();
+
+        m_perf[PERF_TLB_BROADCAST]++;
+        perf_timer timer(this, PERF_BROADCAST_NS);
+        m_env.broadcast_syscall(TLB_FLUSH_BATCH, batch, true);
     }
 
     u64 core::disassemble(u64 addr, char* buf, size_t bufsz) {
@@ -639,11 +2731,12 @@ namespace ocx { namespace arm {
 
         u32 insn = 0;
         u64 size = read_mem_virt(addr, &insn, 4);
+        const bool thumb = is_thumb();
 
-        if (!is_thumb() && size != 4)
+        if (!thumb && size != 4)
             return 0;
 
-        if (is_thumb() && size != 2 && size != 4)
+        if (thumb && size != 2 && size != 4)
             return 0;
 
         cs_insn* sym;
@@ -663,16 +2756,24 @@ namespace ocx { namespace arm {
     }
 
     void core::invalidate_page_ptrs() {
+        prefault_join();
+        m_dmi_cache.clear();
+        m_dmi_regions[0].clear();
+        m_dmi_regions[1].clear();
         uc_err ret = uc_dmi_invalidate(m_uc, 0ull, ~0ull);
         ERROR_ON(ret != UC_ERR_OK, "failed to invalidate all dmi");
     }
 
     void core::invalidate_page_ptrs(u64 start, u64 end) {
+        prefault_join();
+        dmi_cache_invalidate(start, end);
         uc_err ret = uc_dmi_invalidate(m_uc, start, end);
         ERROR_ON(ret != UC_ERR_OK, "failed to invalidate all dmi");
     }
 
     void core::invalidate_page_ptr(u64 pgaddr) {
+        prefault_join();
+        dmi_cache_invalidate(pgaddr, pgaddr + PAGE_SIZE - 1);
         uc_err ret = uc_dmi_invalidate(m_uc, pgaddr, pgaddr + PAGE_SIZE - 1);
         ERROR_ON(ret != UC_ERR_OK, "failed to invalidate dmi ptr");
     }
@@ -680,45 +2781,94 @@ namespace ocx { namespace arm {
     void core::tb_flush() {
         uc_err ret = uc_tb_flush(m_uc);
         ERROR_ON(ret != UC_ERR_OK, "failed to flush TBs");
+        m_code_pages.clear();
+        m_poll_writes.clear();
     }
 
     void core::tb_flush_page(u64 start, u64 end) {
         uc_err ret = uc_tb_flush_page(m_uc, start, end);
         ERROR_ON(ret != UC_ERR_OK, "failed to flush TB page rage");
+        m_poll_writes.clear();
+
+        // the pages get hashed again once code on them is retranslated
+        start &= ~(PAGE_SIZE - 1);
+        if (((end - start) >> PAGE_BITS) < m_code_pages.size()) {
+            for (u64 page = start; page <= end; page += PAGE_SIZE) {
+                m_code_pages.erase(page);
+                if (page + PAGE_SIZE < page)
+                    break;
+            }
+            return;
+        }
+
+        for (auto it = m_code_pages.begin(); it != m_code_pages.end();) {
+            if (it->first >= start && it->first <= end)
+                it = m_code_pages.erase(it);
+            else
+                ++it;
+        }
     }
 
-    bool core::is_aarch64() const {
-        if (!m_model->has_aarch64())
-            return false;
+    const core::exec_state& core::state() const {
+        if (m_state.valid)
+            return m_state;
+
+        u32 aa64 = 0;
+        if (m_model->has_aarch64()) {
+            if (uc_reg_read(m_uc, UC_ARM64_VREG_AA64, &aa64) != UC_ERR_OK)
+                ERROR("failed to read program state");
+        }
+
+        u32 thumb = 0;
+        if (!aa64 && uc_reg_read(m_uc, UC_ARM_VREG_THUMB, &thumb) != UC_ERR_OK)
+            ERROR("failed to read program state");
 
-        u32 state = 0;
-        if (uc_reg_read(m_uc, UC_ARM64_VREG_AA64, &state) != UC_ERR_OK)
+        u64 psr = 0;
+        int reg = aa64 ? (int)UC_ARM64_REG_PSTATE : (int)UC_ARM_REG_CPSR;
+        if (uc_reg_read(m_uc, reg, &psr) != UC_ERR_OK)
             ERROR("failed to read program state");
-        return state;
+
+        m_state.aarch64 = aa64;
+        m_state.thumb = thumb;
+
+        if (aa64) {
+            m_state.el = (psr >> 2) & 0x3;
+        } else {
+            switch (psr & 0x1f) {
+            case 0x10: m_state.el = 0; break; // usr
+            case 0x16: m_state.el = 3; break; // mon
+            case 0x1a: m_state.el = 2; break; // hyp
+            default:   m_state.el = 1; break;
+            }
+        }
+
+        // while executing, state may change under our feet at any time
+        m_state.valid = !m_running;
+        return m_state;
+    }
+
+    bool core::is_aarch64() const {
+        return state().aarch64;
     }
 
     bool core::is_aarch32() const {
-        return !is_aarch64() && !is_thumb();
+        const exec_state& s = state();
+        return !s.aarch64 && !s.thumb;
     }
 
     bool core::is_thumb() const {
-        if (is_aarch64())
-            return false;
+        return state().thumb;
+    }
 
-        u32 state = 0;
-        if (uc_reg_read(m_uc, UC_ARM_VREG_THUMB, &state) != UC_ERR_OK)
-            ERROR("failed to read program state");
-        return state;
+    u8 core::current_el() const {
+        return state().el;
     }
 
     csh core::lookup_disassembler() const {
-        if (is_thumb())
-            return m_cap_thumb;
-        if (is_aarch32())
-            return m_cap_aarch32;
-        if (is_aarch64())
+        const exec_state& s = state();
+        if (s.aarch64)
             return m_cap_aarch64;
-        return 0;
+        return s.thumb ? m_cap_thumb : m_cap_aarch32;
     }
 
     u64 core::get_program_counter() const {
@@ -747,9 +2897,170 @@ namespace ocx { namespace arm {
         if (m_env.transport(tx) != RESP_OK)
             return 0;
 
+        // debug writes count as well, e.g. to code pages, which never get
+        // write DMI
+        if (iswr && m_dirty_on) {
+            dirty_mark_range(addr, tx.size);
+            if (!m_running)
+                dirty_flush();
+        }
+
         return tx.size;
     }
 
+    u8* core::get_page_ptr(u64 page, bool iswr) {
+        u8* ptr = lookup_page_ptr(page, iswr);
+        if (ptr && iswr && m_dirty_on)
+            dirty_mark(page);
+        return ptr;
+    }
+
+    u8* core::lookup_page_ptr(u64 page, bool iswr) {
+        if (m_dmi_region_ext) {
+            u8* ptr = find_region_ptr(page, iswr);
+            if (ptr != nullptr)
+                return ptr;
+        }
+
+        const u8 bit = iswr ? 2 : 1;
+
+        auto it = m_dmi_cache.find(page);
+        if (it != m_dmi_cache.end() && (it->second.known & bit)) {
+            m_perf[PERF_DMI_CACHED]++;
+            return it->second.ptr[iswr];
+        }
+
+        // granted regions are kept in m_dmi_regions, refusals end up in
+        // m_dmi_cache together with the answer for the single page
+        if (m_dmi_region_ext) {
+            u8* ptr = get_region_ptr(page, iswr);
+            if (ptr != nullptr)
+                return ptr;
+        }
+
+        // the env may invalidate pages while we ask it, so only touch the
+        // cache once it has answered
+        u8* ptr = iswr ? m_env.get_page_ptr_w(page) : m_env.get_page_ptr_r(page);
+
+        dmi_entry& e = m_dmi_cache[page];
+        e.ptr[iswr] = ptr;
+        e.known |= bit;
+        return ptr;
+    }
+
+    void core::erase_regions(map<u64, dmi_region>& regions, u64 start,
+                             u64 end) {
+        for (auto it = regions.begin(); it != regions.end();) {
+            if (it->first <= end && it->second.end >= start)
+                it = regions.erase(it);
+            else
+                ++it;
+        }
+    }
+
+    u8* core::find_region_ptr(u64 page, bool iswr) {
+        const map<u64, dmi_region>& regions = m_dmi_regions[iswr];
+
+        auto it = regions.upper_bound(page);
+        if (it == regions.begin())
+            return nullptr;
+
+        --it;
+        if (page + PAGE_SIZE - 1 > it->second.end)
+            return nullptr;
+
+        m_perf[PERF_DMI_CACHED]++;
+        return it->second.ptr + (page - it->first);
+    }
+
+    u8* core::get_region_ptr(u64 page, bool iswr) {
+        map<u64, dmi_region>& regions = m_dmi_regions[iswr];
+
+        u64 start = 0, size = 0;
+        u8* ptr = m_dmi_region_ext->get_region_ptr(page, iswr, start, size);
+        if (ptr == nullptr || size == 0)
+            return nullptr;
+
+        const u64 end = start + size - 1;
+        if (page < start || page + PAGE_SIZE - 1 > end)
+            return nullptr;
+
+        erase_regions(regions, start, end);
+        regions[start] = { end, ptr };
+        return ptr + (page - start);
+    }
+
+    void core::dmi_cache_invalidate(u64 start, u64 end) {
+        for (map<u64, dmi_region>& regions : m_dmi_regions)
+            erase_regions(regions, start, end);
+
+        start &= ~(PAGE_SIZE - 1);
+        if (((end - start) >> PAGE_BITS) < m_dmi_cache.size()) {
+            for (u64 page = start; page <= end; page += PAGE_SIZE) {
+                m_dmi_cache.erase(page);
+                if (page + PAGE_SIZE < page)
+                    break;
+            }
+            return;
+        }
+
+        for (auto it = m_dmi_cache.begin(); it != m_dmi_cache.end();) {
+            if (it->first >= start && it->first <= end)
+                it = m_dmi_cache.erase(it);
+            else
+                ++it;
+        }
+    }
+
+    u8* core::dmi_page_ptr(u64 page, bool iswr) {
+        if (iswr && m_code_pages.count(page))
+            return nullptr;
+
+        return get_page_ptr(page, iswr);
+    }
+
+    size_t core::dmi_range_virt(u64 addr, size_t size, bool iswr, u8*& host) {
+        host = nullptr;
+
+        size_t length = 0;
+        while (length < size) {
+            u64 phys = 0;
+            if (uc_va2pa(m_uc, addr + length, &phys) != UC_ERR_OK)
+                break;
+
+            u8* ptr = dmi_page_ptr(phys & ~(PAGE_SIZE - 1), iswr);
+            if (ptr == nullptr)
+                break;
+
+            // stop as soon as the host side is no longer contiguous
+            ptr += phys & (PAGE_SIZE - 1);
+            if (host != nullptr && ptr != host + length)
+                break;
+
+            if (host == nullptr)
+                host = ptr;
+
+            length += page_chunk(addr + length, size - length);
+        }
+
+        return length;
+    }
+
+    size_t core::access_mem_dmi(u64 addr, u8* buf, size_t bufsz, bool iswr) {
+        const u64 page = addr & ~(PAGE_SIZE - 1);
+        u8* ptr = dmi_page_ptr(page, iswr);
+        if (ptr == nullptr)
+            return 0;
+
+        ptr += addr - page;
+        if (iswr)
+            memcpy(ptr, buf, bufsz);
+        else
+            memcpy(buf, ptr, bufsz);
+
+        return bufsz;
+    }
+
     size_t core::read_mem_virt(u64 addr, void *buf, size_t bufsz) {
         uc_err ret;
         u64 phys = 0;
@@ -768,7 +3079,9 @@ namespace ocx { namespace arm {
             size_t size = std::min(bytes_remaining, page_remaining);
 
             try {
-                size_t page_read = access_mem_phys(phys, bbuf, size, false);
+                size_t page_read = access_mem_dmi(phys, bbuf, size, false);
+                if (page_read == 0)
+                    page_read = access_mem_phys(phys, bbuf, size, false);
                 if (page_read != size)
                     return bytes_read + page_read;
             } catch (...) {
@@ -802,7 +3115,9 @@ namespace ocx { namespace arm {
             size_t size = std::min(bytes_remaining, page_remaining);
 
             try {
-                 size_t page_written = access_mem_phys(phys, bbuf, size, true);
+                 size_t page_written = access_mem_dmi(phys, bbuf, size, true);
+                 if (page_written == 0)
+                     page_written = access_mem_phys(phys, bbuf, size, true);
                  if (page_written != size)
                      return bytes_written + page_written;
              } catch (...) {
@@ -819,68 +3134,34 @@ namespace ocx { namespace arm {
          return bytes_written;
     }
 
-#ifdef _MSC_VER
-    // MSVC does not support arithemtic on 128bit integral types, but we are
-    // linking mingw libgcc.a lib anyway so we can use __udivti3 from there
-
-    extern "C" __m128 __udivti3(__m128* dividend, __m128* divisor);
-
-    inline u64 mult_div_128(u64 mult1, u64 mult2, u64 quot, bool& overflow) {
-        __m128 p, q;
-        p.m128_u64[0] = _umul128(mult1, mult2, &p.m128_u64[1]);
-        q.m128_u64[0] = quot;
-        q.m128_u64[1] = 0;
-        __m128 r = __udivti3(&p, &q);
-        overflow = (bool)r.m128_u64[1];
-        return r.m128_u64[0];
-    }
-
-    inline void add_128_64(__m128& a, u64 b) {
-        u8 c1 = _addcarry_u64( 0, a.m128_u64[0], b, &a.m128_u64[0]);
-        u8 c2 = _addcarry_u64(c1, a.m128_u64[1], 0, &a.m128_u64[1]);
-    }
-
-    inline u64 mult_div_128_round_up(u64 mult1, u64 mult2, u64 quot, bool& overflow) {
-        __m128 p, q;
-        p.m128_u64[0] = _umul128(mult1, mult2, &p.m128_u64[1]);
-        add_128_64(p, quot - 1);
-        q.m128_u64[0] = quot;
-        q.m128_u64[1] = 0;
-        __m128 r = __udivti3(&p, &q);
-        overflow = (bool)r.m128_u64[1];
-        return r.m128_u64[0];
-    }
-
-#else
-    inline u64 mult_div_128(u64 mult1, u64 mult2, u64 quot, bool& overflow) {
-        typedef unsigned __int128 u128;
-        u128 prod = (u128)mult1 * (u128)mult2;
-        u128 result = prod / quot;
-        overflow = (bool)(u64)(result >> 64);
-        return (u64)result;
-    }
-
-    inline u64 mult_div_128_round_up(u64 mult1, u64 mult2, u64 quot, bool& overflow) {
-        typedef unsigned __int128 u128;
-        u128 prod = (u128)mult1 * (u128)mult2;
-        u128 result = (prod + quot - 1) / quot;
-        overflow = (bool)(u64)(result >> 64);
-        return (u64)result;
-    }
-
-#endif
-
     uint64_t core::helper_time(void* opaque, u64 clock) {
         core* cpu = (core*)opaque;
         bool overflow;
-        u64 time_ps = cpu->m_env.get_time_ps();
-        u64 ticks = mult_div_128(time_ps, clock, PS_PER_SEC, overflow);
+        u64 time_ps;
+
+        if (cpu->m_local_ps_per_insn && cpu->m_running) {
+            time_ps = cpu->m_local_time_ps + cpu->m_local_ps_per_insn *
+                      uc_instruction_count(cpu->m_uc);
+        } else if (cpu->m_local_ps_per_insn) {
+            // between steps, the env may still lag behind the local time
+            // the last step ended at; as in step, never go back from it
+            time_ps = max(cpu->env_time_ps(), cpu->m_local_time_ps);
+        } else {
+            time_ps = cpu->env_time_ps();
+        }
+
+        if (cpu->m_timer_clock.clock() != clock)
+            cpu->m_timer_clock.setup(clock);
+
+        u64 ticks = cpu->m_timer_clock.ps_to_ticks(time_ps, overflow);
         ERROR_ON(overflow, "ticks out of bounds");
         return ticks;
     }
 
     void core::helper_time_irq(void* opaque, int idx, int set) {
         core* cpu = (core*)opaque;
+        cpu->m_perf[PERF_SIGNAL]++;
+        perf_timer timer(cpu, PERF_SIGNAL_NS);
         cpu->m_env.signal(idx, set);
     }
 
@@ -889,22 +3170,33 @@ namespace ocx { namespace arm {
             ERROR("invalid timer index %d", idx);
 
         core* cpu = (core*)opaque;
+        cpu->m_perf[PERF_SCHEDULE]++;
+        perf_timer timer(cpu, PERF_SCHEDULE_NS);
 
         if (ticks == UINT64_MAX) {
+            cpu->m_timer_deadline[idx] = UINT64_MAX;
             cpu->m_env.cancel(idx);
             return;
         }
 
         if (ticks == (u64)INT64_MAX) {
+            cpu->m_timer_deadline[idx] = UINT64_MAX;
             cpu->m_env.notify(idx, UINT64_MAX);
             return;
         }
 
+        if (cpu->m_timer_clock.clock() != clock)
+            cpu->m_timer_clock.setup(clock);
+
         bool overflow;
-        u64 time_ps = mult_div_128_round_up(ticks, PS_PER_SEC, clock, overflow);
+        u64 time_ps = cpu->m_timer_clock.ticks_to_ps(ticks, overflow);
         if (overflow)
             time_ps = UINT64_MAX;
+        cpu->m_timer_deadline[idx] = time_ps;
         cpu->m_env.notify(idx, time_ps);
+
+        if (cpu->m_in_step_until && time_ps < cpu->m_run_deadline_ps)
+            cpu->stop_for(STOP_RESCHEDULE);
     }
 
     uc_tx_result_t core::helper_transport(uc_engine* uc, void* opaque,
@@ -926,34 +3218,76 @@ namespace ocx { namespace arm {
             /*.is_debug = */    uc_is_debug(cpu->m_uc)
         };
 
-        response resp = cpu->m_env.transport(xt);
+        cpu->m_perf[PERF_TRANSPORT]++;
+        response resp;
+        {
+            perf_timer timer(cpu, PERF_TRANSPORT_NS);
+            resp = cpu->m_env.transport(xt);
+        }
+
         if (resp == RESP_NOT_EXCLUSIVE)
             uc_clear_excl(cpu->m_uc);
+
+        if (cpu->m_dirty_on && !tx->is_read && resp == RESP_OK)
+            cpu->dirty_mark_range(tx->addr, tx->size);
+
+        if (cpu->m_poll_limit) {
+            if (tx->is_read) {
+                cpu->m_poll_hash = fnv1a(cpu->m_poll_hash ^ tx->addr,
+                                         tx->data, tx->size);
+            } else {
+                cpu->m_poll_clean = false;
+            }
+        }
+
         return translate_response(resp);
     }
 
     bool core::helper_dmi(void* opaque, u64 page, unsigned char** dmiptr,
                           int* prot) {
         core* cpu = (core*)opaque;
+        perf_timer timer(cpu, PERF_DMI_NS);
+        bool granted = cpu->lookup_dmi(page, dmiptr, prot);
+        cpu->m_perf[granted ? PERF_DMI_GRANTED : PERF_DMI_REFUSED]++;
+        return granted;
+    }
 
+    bool core::lookup_dmi(u64 page, unsigned char** dmiptr, int* prot) {
         u8* r = nullptr;
         u8* w = nullptr;
 
         if (!prot || !*prot)
             return false;
 
+        // clean pages must not be writable without us noticing, so they
+        // are only mapped for reading and executing: the translator maps
+        // the permissions left in prot and sends writes to the slow path
+        const bool clean = m_dirty_on && !m_dirty.test(page >> PAGE_BITS);
+
         if (*prot == -1) { // mmu is off
-            *dmiptr = cpu->m_env.get_page_ptr_w(page);
+            if (clean) {
+                *prot = UC_PROT_READ | UC_PROT_EXEC;
+                *dmiptr = get_page_ptr(page, false);
+                return *dmiptr != nullptr;
+            }
+
+            *dmiptr = get_page_ptr(page, true);
             return *dmiptr != nullptr;
         }
 
+        if (clean) {
+            *prot &= ~UC_PROT_WRITE;
+            if (!*prot)
+                return false;
+        }
+
         if (*prot & (UC_PROT_READ | UC_PROT_EXEC)) {
-            if (!(r = cpu->m_env.get_page_ptr_r(page)))
+            if (!(r = get_page_ptr(page, false)))
                 return false;
         }
 
         if (*prot & UC_PROT_WRITE) {
-            if (!(w = cpu->m_env.get_page_ptr_w(page)))
+            if (!(w = get_page_ptr(page, true)))
                 return false;
         }
 
@@ -967,38 +3301,84 @@ namespace ocx { namespace arm {
 
     void core::helper_pgprot(void* opaque, unsigned char* ptr, uint64_t addr) {
         core* cpu = (core*)opaque;
+        const u64 page = addr & ~(PAGE_SIZE - 1);
+
+        // hash what gets translated now, the page may have been rewritten
+        // since it was protected before
+        cpu->m_code_pages[page] = cpu->m_warm_reset ?
+                                  cpu->code_page_hash(page) : 0;
         cpu->m_env.protect_page(ptr, addr);
     }
 
     void core::helper_tlb_cluster_flush(void* opaque) {
         core* cpu = (core*)opaque;
+        cpu->m_perf[PERF_TLB_FLUSH]++;
+
+        if (cpu->m_tlb_defer) {
+            uc_err ret = uc_tlb_flush(cpu->m_uc);
+            ERROR_ON(ret != UC_ERR_OK, "failed to flush TLB");
+            cpu->m_tlb_all = true;
+            return;
+        }
+
         shared_ptr<void> arg(nullptr);
+        perf_timer timer(cpu, PERF_BROADCAST_NS);
         cpu->m_env.broadcast_syscall(TLB_FLUSH, move(arg), true);
     }
 
     void core::helper_tlb_cluster_flush_page(void* opaque, u64 addr) {
         core* cpu = (core*)opaque;
+        cpu->m_perf[PERF_TLB_FLUSH_PAGE]++;
+
+        if (cpu->m_tlb_defer) {
+            uc_err ret = uc_tlb_flush_page(cpu->m_uc, addr);
+            ERROR_ON(ret != UC_ERR_OK, "failed to flush TLB entry");
+            cpu->queue_tlb_flush_page(addr, 0);
+            return;
+        }
+
         shared_ptr<void> arg(new u64(addr));
+        perf_timer timer(cpu, PERF_BROADCAST_NS);
         cpu->m_env.broadcast_syscall(TLB_FLUSH_PAGE, move(arg), true);
     }
 
     void core::helper_tlb_cluster_flush_mmuidx(void* opaque, uint16_t idxmap) {
         core* cpu = (core*)opaque;
+        cpu->m_perf[PERF_TLB_FLUSH_MMUIDX]++;
+
+        if (cpu->m_tlb_defer) {
+            uc_err ret = uc_tlb_flush_mmuidx(cpu->m_uc, idxmap);
+            ERROR_ON(ret != UC_ERR_OK, "failed to flush TLB");
+            cpu->m_tlb_idxmap |= idxmap;
+            return;
+        }
+
         shared_ptr<void> arg(new uint16_t(idxmap));
+        perf_timer timer(cpu, PERF_BROADCAST_NS);
         cpu->m_env.broadcast_syscall(TLB_FLUSH_MMUIDX, move(arg), true);
     }
 
     void core::helper_tlb_cluster_flush_page_mmuidx(void* opaque, u64 addr,
                                                     uint16_t idxmap) {
         core* cpu = (core*)opaque;
+        cpu->m_perf[PERF_TLB_FLUSH_PAGE_MMUIDX]++;
+
+        if (cpu->m_tlb_defer) {
+            uc_err ret = uc_tlb_flush_page_mmuidx(cpu->m_uc, addr, idxmap);
+            ERROR_ON(ret != UC_ERR_OK, "failed to flush TLB entry");
+            cpu->queue_tlb_flush_page(addr, idxmap);
+            return;
+        }
+
         shared_ptr<void> arg(new flush_page_mmuidx_args { addr, idxmap });
+        perf_timer timer(cpu, PERF_BROADCAST_NS);
         cpu->m_env.broadcast_syscall(TLB_FLUSH_PAGE_MMUIDX, move(arg), true);
     }
 
     void core::helper_breakpoint(void* opaque, u64 addr) {
         core* cpu = (core*)opaque;
         if (cpu->m_env.handle_breakpoint(addr)) {
-            uc_emu_stop(cpu->m_uc);
+            cpu->stop_for(STOP_BREAKPOINT);
         }
     }
 
@@ -1006,13 +3386,38 @@ namespace ocx { namespace arm {
                                  bool iswr) {
         core* cpu = (core*)opaque;
         if (cpu->m_env.handle_watchpoint(addr, size, data, iswr)) {
-            uc_emu_stop(cpu->m_uc);
+            cpu->stop_for(STOP_WATCHPOINT);
         }
     }
 
     void core::helper_trace_bb(void* opaque, u64 pc) {
         core* cpu = (core*)opaque;
-        cpu->m_env.handle_begin_basic_block(pc);
+        if (cpu->m_poll_limit)
+            cpu->poll_block(pc);
+        if (cpu->m_profile_on)
+            cpu->profile_block(pc);
+        if (cpu->m_trace_bb)
+            cpu->m_env.handle_begin_basic_block(pc);
+    }
+
+    void core::helper_bbtrace(uc_engine* uc, u64 addr, u32 size,
+                              void* opaque) {
+        (void)uc;
+        core* cpu = (core*)opaque;
+        bbtrace_writer* writer = cpu->m_bbtrace.get();
+
+        if (writer->is_sequential(addr)) {
+            writer->extend(size);
+            return;
+        }
+
+        // an exception taken in the middle of the last block ended its run
+        // at the preferred return address, e.g. before a faulting load
+        u64 ret;
+        if (cpu->bbtrace_exception(addr, ret))
+            writer->truncate(ret);
+
+        writer->branch(addr, size, cpu->bbtrace_isa());
     }
 
     void core::helper_trace_insn(uc_engine* uc, u64 vaddr,
@@ -1022,6 +3427,35 @@ namespace ocx { namespace arm {
         cpu->m_trace_insns->handle_trace_insn(vaddr, size);
     }
 
+    void core::helper_trace_insn_batch(uc_engine* uc, u64 vaddr,
+                                       u64 size, void* opaque) {
+        (void)uc;
+        core* cpu = (core*)opaque;
+        trace_insn_record& rec = cpu->m_trace_buf[cpu->m_trace_len++];
+        rec.vaddr = vaddr;
+        rec.size = size;
+        if (cpu->m_trace_len == cpu->m_trace_buf.size())
+            cpu->flush_trace_insns();
+    }
+
+    void core::helper_trace_insn_filtered(uc_engine* uc, u64 vaddr,
+                                          u64 size, void* opaque) {
+        core* cpu = (core*)opaque;
+
+        u32 el_mask = cpu->m_trace_el_mask;
+        if (el_mask && !(el_mask & (1u << cpu->current_el())))
+            return;
+
+        i64 asid = cpu->m_trace_asid;
+        if (asid >= 0 && cpu->current_asid() != (u64)asid)
+            return;
+
+        if (cpu->m_trace_batch)
+            helper_trace_insn_batch(uc, vaddr, size, opaque);
+        else
+            helper_trace_insn(uc, vaddr, size, opaque);
+    }
+
     void core::helper_hint(void* opaque, uc_hint_t hint) {
         core* cpu = (core*)opaque;
         env &e = cpu->m_env;
@@ -1029,7 +3463,7 @@ namespace ocx { namespace arm {
         switch (hint) {
         case UC_HINT_YIELD:
             e.hint(HINT_YIELD);
-            uc_emu_stop(cpu->m_uc);
+            cpu->stop_for(STOP_YIELD);
             break;
 
         case UC_HINT_WFE:
@@ -1038,6 +3472,10 @@ namespace ocx { namespace arm {
 
         case UC_HINT_WFI:
             e.hint(HINT_WFI);
+            if (cpu->m_idle_skip && !cpu->m_irq_lines) {
+                cpu->idle_enter();
+                cpu->stop_for(STOP_IDLE);
+            }
             break;
 
         case UC_HINT_SEV:
@@ -1072,13 +3510,73 @@ namespace ocx { namespace arm {
     // ARM semihosting implementation
     //
 
+    void core::console_open() {
+        m_console_fd = STDOUT_FILENO;
+
+        const char* prefix = m_env.get_param("semihosting_console");
+        if (prefix == nullptr || *prefix == '\0')
+            return;
+
+        char name[1024];
+        snprintf(name, sizeof(name), "%s.%" PRIu64 ".%" PRIu64, prefix,
+                 m_procid, m_coreid);
+
+        int fd = open(name, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0644);
+        if (fd < 0) {
+            INFO("cannot open console file '%s': %s", name, strerror(errno));
+            return;
+        }
+
+        m_console_fd = fd;
+    }
+
+    void core::console_write(int fd, const void* data, size_t size) {
+        if (m_console_fd < 0)
+            console_open();
+
+        // keep the order of what goes to stdout and stderr
+        const int idx = fd == STDERR_FILENO && m_console_fd == STDOUT_FILENO;
+        console_flush(!idx);
+
+        string& buf = m_console_buf[idx];
+        buf.append((const char*)data, size);
+        if (buf.size() >= CONSOLE_BUFSZ || memchr(data, '\n', size))
+            console_flush(idx);
+    }
+
+    void core::console_flush(int idx) {
+        string& buf = m_console_buf[idx];
+        if (buf.empty())
+            return;
+
+        write_all(idx ? STDERR_FILENO : m_console_fd, buf.data(), buf.size());
+        buf.clear();
+    }
+
+    void core::console_flush() {
+        console_flush(0);
+        console_flush(1);
+    }
+
     string core::semihosting_read_string(u64 addr, size_t n) {
         string result;
-        char buffer = ~0;
-        while (n-- && buffer != '\0') {
-            if (read_mem_virt(addr++, (unsigned char*)&buffer, 1) != 1)
-                ERROR("failed to read char at 0x%016" PRIx64, addr - 1);
-            result += buffer;
+        char buffer[PAGE_SIZE];
+
+        while (n > 0) {
+            size_t chunk = page_chunk(addr, n);
+            size_t size = read_mem_virt(addr, buffer, chunk);
+            if (size != chunk)
+                ERROR("failed to read char at 0x%016" PRIx64, addr + size);
+
+            const char* end = (const char*)memchr(buffer, '\0', chunk);
+            if (end != nullptr) {
+                result.append(buffer, end - buffer);
+                break;
+            }
+
+            result.append(buffer, chunk);
+            addr += chunk;
+            n -= chunk;
         }
 
         return result;
@@ -1165,14 +3663,17 @@ namespace ocx { namespace arm {
             return CLOCKS_PER_SEC;
 
         case SHC_EXIT:
+            console_flush();
             INFO("arm semihosting: software exit request");
             exit((int)semihosting_read_reg(1));
 
         case SHC_EXIT2:
+            console_flush();
             INFO("arm semihosting: software exit request");
             exit((int)(semihosting_read_reg(1) >> 32));
 
         case SHC_READC:
+            console_flush();
             return getchar();
 
         case SHC_ERRNO:
@@ -1183,20 +3684,28 @@ namespace ocx { namespace arm {
             u64 addr = semihosting_read_reg(1);
             if (read_mem_virt(addr, &c, sizeof(c)) != sizeof(c))
                 return ~0ull;
-            putchar(c);
+            console_write(STDOUT_FILENO, &c, sizeof(c));
             return c;
         }
 
         case SHC_WRITE0: {
-            unsigned char c;
+            char buffer[PAGE_SIZE];
             u64 addr = semihosting_read_reg(1);
-            do {
-                if (read_mem_virt(addr++, &c, sizeof(c)) != sizeof(c))
-                    break;
-                if (c != '\0')
-                    putchar(c);
-            } while (c != '\0');
-            return addr;
+            for (;;) {
+                size_t chunk = page_chunk(addr, PAGE_SIZE);
+                size_t size = read_mem_virt(addr, buffer, chunk);
+                const char* end = (const char*)memchr(buffer, '\0', size);
+                if (end != nullptr)
+                    size = end - buffer;
+
+                console_write(STDOUT_FILENO, buffer, size);
+                addr += size;
+
+                if (end != nullptr)
+                    return addr + 1;
+                if (size != chunk)
+                    return addr;
+            }
         }
 
         case SHC_OPEN: {
@@ -1225,16 +3734,27 @@ namespace ocx { namespace arm {
             u64 addr = semihosting_read_field(1);
             u64 size = semihosting_read_field(2);
 
+            u8 buffer[PAGE_SIZE];
             while (size > 0) {
-                unsigned char buffer = 0;
-                if (read_mem_virt(addr, &buffer, 1) != 1)
+                size_t chunk = page_chunk(addr, size);
+                size_t n = read_mem_virt(addr, buffer, chunk);
+                if (n == 0)
                     return size;
 
-                if (write((int)file, &buffer, 1) != 1)
+                ssize_t written = n;
+                if (file == STDOUT_FILENO || file == STDERR_FILENO)
+                    console_write((int)file, buffer, n);
+                else
+                    written = write((int)file, buffer, (unsigned int)n);
+
+                if (written <= 0)
                     return size;
 
-                size--;
-                addr++;
+                size -= written;
+                addr += written;
+
+                if ((size_t)written != chunk)
+                    return size;
             }
 
             return 0;
@@ -1261,16 +3781,26 @@ namespace ocx { namespace arm {
             u64 addr = semihosting_read_field(1);
             u64 size = semihosting_read_field(2);
 
-            u8 buffer[4096];
+            std::vector<u8> buffer;
             size_t bytes_read = 0;
             size_t bytes_todo = size;
 
             while (bytes_todo > 0) {
-                size_t sz = bytes_todo;
-                if (sz > sizeof(buffer))
-                    sz = sizeof(buffer);
+                // read straight into guest memory if it is DMI mapped,
+                // otherwise bounce through a buffer and write_mem_virt
+                u8* host = nullptr;
+                size_t sz = dmi_range_virt(addr + bytes_read,
+                    std::min(bytes_todo, (size_t)SHC_READ_DMI_MAX), true, host);
+
+                u8* dest = host;
+                if (dest == nullptr) {
+                    sz = std::min(bytes_todo, (size_t)SHC_READ_BUF_MAX);
+                    if (buffer.size() < sz)
+                        buffer.resize(sz);
+                    dest = buffer.data();
+                }
 
-                ssize_t n = read((int)file, buffer, (unsigned int)sz);
+                ssize_t n = read((int)file, dest, (unsigned int)sz);
                 if (n < 0) {
                     INFO("arm semihosting read failure %s", strerror(errno));
                     return bytes_todo;
@@ -1279,7 +3809,8 @@ namespace ocx { namespace arm {
                 if (n == 0)
                     return bytes_todo;
 
-                if (write_mem_virt(addr + bytes_read, buffer, n) != (size_t)n) {
+                if (host == nullptr &&
+                    write_mem_virt(addr + bytes_read, dest, n) != (size_t)n) {
                     INFO("arm semihosting store failure");
                     return bytes_todo;
                 }
@@ -0,0 +1,187 @@
+/******************************************************************************
+ * Copyright (C) 2019 Synopsys, Inc.
+ * This source code is licensed under the MIT license found in the
+ * LICENSE file in the root directory of this source tree.
+ ******************************************************************************/
+
+#include "bbtrace.h"
+#include "common.h"
+
+#ifdef _MSC_VER
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+namespace ocx { namespace arm {
+
+    static const u8 BBTRACE_MAGIC[] = { 'O', 'C', 'X', 'B', 'T' };
+    static const u8 BBTRACE_VERSION = 1;
+
+    // emit an absolute address every so many branches
+    static const u64 BBTRACE_SYNC_PERIOD = 1024;
+
+    // write out to the file once this much data has been collected
+    static const size_t BBTRACE_FLUSH_SIZE = 64 * 1024;
+
+    static u64 zigzag(u64 delta) {
+        return (delta << 1) ^ (u64)((i64)delta >> 63);
+    }
+
+    static u64 unzigzag(u64 val) {
+        return (val >> 1) ^ (~(val & 1) + 1);
+    }
+
+    bbtrace_writer::bbtrace_writer(int fd):
+        m_fd(fd),
+        m_buf(BBTRACE_MAGIC, BBTRACE_MAGIC + sizeof(BBTRACE_MAGIC)),
+        m_started(false),
+        m_isa(BBTRACE_A64),
+        m_start(0),
+        m_end(0),
+        m_branches(0) {
+        put(BBTRACE_VERSION);
+    }
+
+    bbtrace_writer::~bbtrace_writer() {
+        finish();
+    }
+
+    void bbtrace_writer::put_varint(u64 val) {
+        while (val >= 0x80) {
+            put((u8)(val | 0x80));
+            val >>= 7;
+        }
+        put((u8)val);
+    }
+
+    void bbtrace_writer::put_sync() {
+        put(BBTRACE_SYNC);
+        put_varint(m_isa);
+        put_varint(m_start);
+    }
+
+    void bbtrace_writer::flush(size_t threshold) {
+        if (m_fd < 0 || m_buf.size() < threshold)
+            return;
+
+        const u8* data = m_buf.data();
+        size_t size = m_buf.size();
+        while (size > 0) {
+            auto n = write(m_fd, data, (unsigned int)size);
+            ERROR_ON(n <= 0, "failed to write branch trace");
+            data += n;
+            size -= n;
+        }
+
+        m_buf.clear();
+    }
+
+    void bbtrace_writer::branch(u64 target, u64 size, int isa) {
+        if (!m_started) {
+            m_started = true;
+            m_isa = isa;
+            m_start = target;
+            m_end = target + size;
+            put_sync();
+            return;
+        }
+
+        put(BBTRACE_BRANCH);
+        put_varint(m_end - m_start);
+        put_varint(zigzag(target - m_end));
+
+        m_start = target;
+        m_end = target + size;
+
+        if (isa != m_isa) {
+            m_isa = isa;
+            put(BBTRACE_ISA);
+            put_varint(isa);
+        }
+
+        if (++m_branches % BBTRACE_SYNC_PERIOD == 0)
+            put_sync();
+
+        flush(BBTRACE_FLUSH_SIZE);
+    }
+
+    void bbtrace_writer::truncate(u64 pc) {
+        // execution stopped inside the last block, e.g. because the step
+        // ran out of instructions or an exception got taken; only count
+        // what actually got executed, which may be nothing at all
+        if (m_started && pc >= m_start && pc < m_end)
+            m_end = pc;
+    }
+
+    void bbtrace_writer::finish() {
+        if (m_started && m_end != m_start) {
+            put(BBTRACE_RUN);
+            put_varint(m_end - m_start);
+            m_start = m_end;
+        }
+
+        flush(0);
+    }
+
+    bbtrace_parser::bbtrace_parser(const u8* data, size_t size):
+        m_pos(data),
+        m_end(data + size),
+        m_valid(false) {
+        if (size <= sizeof(BBTRACE_MAGIC))
+            return;
+
+        if (memcmp(data, BBTRACE_MAGIC, sizeof(BBTRACE_MAGIC)) != 0)
+            return;
+
+        if (data[sizeof(BBTRACE_MAGIC)] != BBTRACE_VERSION)
+            return;
+
+        m_pos += sizeof(BBTRACE_MAGIC) + 1;
+        m_valid = true;
+    }
+
+    bool bbtrace_parser::get_varint(u64& val) {
+        val = 0;
+        for (unsigned int shift = 0; shift < 64; shift += 7) {
+            if (m_pos == m_end)
+                return false;
+
+            u8 byte = *m_pos++;
+            val |= (u64)(byte & 0x7f) << shift;
+            if (!(byte & 0x80))
+                return true;
+        }
+
+        return false;
+    }
+
+    bool bbtrace_parser::next(int& kind, u64& a, u64& b) {
+        if (!m_valid || m_pos == m_end)
+            return false;
+
+        kind = *m_pos++;
+        a = b = 0;
+
+        switch (kind) {
+        case BBTRACE_SYNC:
+        case BBTRACE_BRANCH:
+            m_valid = get_varint(a) && get_varint(b);
+            if (kind == BBTRACE_BRANCH)
+                b = unzigzag(b);
+            break;
+
+        case BBTRACE_ISA:
+        case BBTRACE_RUN:
+            m_valid = get_varint(a);
+            break;
+
+        default:
+            m_valid = false;
+            break;
+        }
+
+        return m_valid;
+    }
+
+}}
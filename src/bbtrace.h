@@ -0,0 +1,98 @@
+/******************************************************************************
+ * Copyright (C) 2019 Synopsys, Inc.
+ * This source code is licensed under the MIT license found in the
+ * LICENSE file in the root directory of this source tree.
+ ******************************************************************************/
+
+#ifndef BBTRACE_H
+#define BBTRACE_H
+
+#include <ocx/ocx.h>
+
+#include <vector>
+#include <stddef.h>
+
+namespace ocx { namespace arm {
+
+    // Compressed branch trace stream. Execution is recorded as runs of
+    // linearly executed code bytes, each ending in a non-sequential transfer
+    // of control; block transitions that fall through produce no output.
+    // Runs may be empty if execution stopped before the first instruction.
+    // All numbers are LEB128 encoded, deltas are zigzag encoded first.
+    //
+    //   header            "OCXBT" version
+    //   SYNC    0x01      isa addr      restart at absolute address
+    //   BRANCH  0x02      bytes delta   run of bytes, then continue at
+    //                                   end of run + delta
+    //   ISA     0x03      isa           instruction set from here on
+    //   RUN     0x04      bytes         run of bytes without a transfer
+
+    enum bbtrace_isa {
+        BBTRACE_A64 = 0,
+        BBTRACE_A32 = 1,
+        BBTRACE_T32 = 2,
+    };
+
+    enum bbtrace_packet {
+        BBTRACE_SYNC   = 0x01,
+        BBTRACE_BRANCH = 0x02,
+        BBTRACE_ISA    = 0x03,
+        BBTRACE_RUN    = 0x04,
+    };
+
+    class bbtrace_writer {
+    public:
+        // streams to fd if it is valid, otherwise collects into data()
+        bbtrace_writer(int fd);
+        ~bbtrace_writer();
+
+        bool is_sequential(u64 start) const {
+            return m_started && start == m_end;
+        }
+
+        void extend(u64 size) { m_end += size; }
+
+        void branch(u64 target, u64 size, int isa);
+
+        // ends the current run at pc if that lies inside it
+        void truncate(u64 pc);
+        void finish();
+
+        const std::vector<u8>& data() const { return m_buf; }
+
+    private:
+        int             m_fd;
+        std::vector<u8> m_buf;
+        bool            m_started;
+        int             m_isa;
+        u64             m_start;
+        u64             m_end;
+        u64             m_branches;
+
+        void put(u8 byte) { m_buf.push_back(byte); }
+        void put_varint(u64 val);
+        void put_sync();
+        void flush(size_t threshold);
+    };
+
+    class bbtrace_parser {
+    public:
+        bbtrace_parser(const u8* data, size_t size);
+
+        bool valid() const { return m_valid; }
+
+        // returns false at the end of the stream or on malformed input;
+        // for BRANCH, b holds the two's complement of the jump delta
+        bool next(int& kind, u64& a, u64& b);
+
+    private:
+        const u8* m_pos;
+        const u8* m_end;
+        bool      m_valid;
+
+        bool get_varint(u64& val);
+    };
+
+}}
+
+#endif
@@ -0,0 +1,142 @@
+/******************************************************************************
+ * Copyright (C) 2019 Synopsys, Inc.
+ * This source code is licensed under the MIT license found in the
+ * LICENSE file in the root directory of this source tree.
+ ******************************************************************************/
+
+#include "clock.h"
+
+#include <stdint.h>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#include <immintrin.h>
+#include <xmmintrin.h>
+#  pragma warning(disable: 4800)
+#endif
+
+namespace ocx { namespace arm {
+
+#ifdef _MSC_VER
+    // MSVC does not support arithemtic on 128bit integral types, but we are
+    // linking mingw libgcc.a lib anyway so we can use __udivti3 from there
+
+    extern "C" __m128 __udivti3(__m128* dividend, __m128* divisor);
+
+    u64 mult_div_128(u64 mult1, u64 mult2, u64 quot, bool& overflow) {
+        __m128 p, q;
+        p.m128_u64[0] = _umul128(mult1, mult2, &p.m128_u64[1]);
+        q.m128_u64[0] = quot;
+        q.m128_u64[1] = 0;
+        __m128 r = __udivti3(&p, &q);
+        overflow = (bool)r.m128_u64[1];
+        return r.m128_u64[0];
+    }
+
+    static inline void add_128_64(__m128& a, u64 b) {
+        u8 c1 = _addcarry_u64( 0, a.m128_u64[0], b, &a.m128_u64[0]);
+        u8 c2 = _addcarry_u64(c1, a.m128_u64[1], 0, &a.m128_u64[1]);
+    }
+
+    u64 mult_div_128_round_up(u64 mult1, u64 mult2, u64 quot, bool& overflow) {
+        __m128 p, q;
+        p.m128_u64[0] = _umul128(mult1, mult2, &p.m128_u64[1]);
+        add_128_64(p, quot - 1);
+        q.m128_u64[0] = quot;
+        q.m128_u64[1] = 0;
+        __m128 r = __udivti3(&p, &q);
+        overflow = (bool)r.m128_u64[1];
+        return r.m128_u64[0];
+    }
+
+    static inline void mult_128(u64 mult1, u64 mult2, u64& hi, u64& lo) {
+        lo = _umul128(mult1, mult2, &hi);
+    }
+
+#else
+    typedef unsigned __int128 u128;
+
+    u64 mult_div_128(u64 mult1, u64 mult2, u64 quot, bool& overflow) {
+        u128 prod = (u128)mult1 * (u128)mult2;
+        u128 result = prod / quot;
+        overflow = (bool)(u64)(result >> 64);
+        return (u64)result;
+    }
+
+    u64 mult_div_128_round_up(u64 mult1, u64 mult2, u64 quot, bool& overflow) {
+        u128 prod = (u128)mult1 * (u128)mult2;
+        u128 result = (prod + quot - 1) / quot;
+        overflow = (bool)(u64)(result >> 64);
+        return (u64)result;
+    }
+
+    static inline void mult_128(u64 mult1, u64 mult2, u64& hi, u64& lo) {
+        u128 prod = (u128)mult1 * (u128)mult2;
+        hi = (u64)(prod >> 64);
+        lo = (u64)prod;
+    }
+
+#endif
+
+    // compares mult1 * mult2 against (hi:lo), returns <0, 0 or >0
+    static inline int cmp_128(u64 mult1, u64 mult2, u64 hi, u64 lo) {
+        u64 phi, plo;
+        mult_128(mult1, mult2, phi, plo);
+        if (phi != hi)
+            return phi < hi ? -1 : 1;
+        if (plo != lo)
+            return plo < lo ? -1 : 1;
+        return 0;
+    }
+
+    // (mult1 * mult2) >> 63, fails if that does not fit into 64 bits
+    static inline bool mult_fix_63(u64 mult1, u64 mult2, u64& result) {
+        u64 hi, lo;
+        mult_128(mult1, mult2, hi, lo);
+        result = hi << 1 | lo >> 63;
+        return !(hi >> 63);
+    }
+
+    clock_converter::clock_converter():
+        m_clock(0),
+        m_fast(false),
+        m_ticks_per_ps(0) {
+    }
+
+    void clock_converter::setup(u64 clock) {
+        m_clock = clock;
+
+        // the reciprocal needs to fit into 1.63 fixed point
+        m_fast = clock > 0 && clock < PS_PER_SEC;
+        if (!m_fast)
+            return;
+
+        bool overflow;
+        m_ticks_per_ps = mult_div_128_round_up(clock, 1ull << 63, PS_PER_SEC,
+                                               overflow);
+    }
+
+    u64 clock_converter::ps_to_ticks(u64 ps, bool& overflow) const {
+        // the reciprocal is rounded up by less than 2^-63, so the estimate
+        // is at most two ticks too large for any 64 bit ps
+        u64 ticks;
+        if (!m_fast || !mult_fix_63(ps, m_ticks_per_ps, ticks))
+            return mult_div_128(ps, m_clock, PS_PER_SEC, overflow);
+
+        u64 hi, lo;
+        mult_128(ps, m_clock, hi, lo);
+        while (cmp_128(ticks, PS_PER_SEC, hi, lo) > 0)
+            ticks--;
+
+        overflow = false;
+        return ticks;
+    }
+
+    u64 clock_converter::ticks_to_ps(u64 ticks, bool& overflow) const {
+        // unless the clock divides PS_PER_SEC, rounding up needs several
+        // correction steps, which bench/clockbench.cpp measured to be
+        // slower than dividing
+        return mult_div_128_round_up(ticks, PS_PER_SEC, m_clock, overflow);
+    }
+
+}}
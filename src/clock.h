@@ -0,0 +1,42 @@
+/******************************************************************************
+ * Copyright (C) 2019 Synopsys, Inc.
+ * This source code is licensed under the MIT license found in the
+ * LICENSE file in the root directory of this source tree.
+ ******************************************************************************/
+
+#ifndef CLOCK_H
+#define CLOCK_H
+
+#include <ocx/ocx.h>
+
+namespace ocx { namespace arm {
+
+    const u64 PS_PER_SEC = 1000000000000ull;
+
+    u64 mult_div_128(u64 mult1, u64 mult2, u64 quot, bool& overflow);
+    u64 mult_div_128_round_up(u64 mult1, u64 mult2, u64 quot, bool& overflow);
+
+    // Converts between picoseconds and ticks of a clock. ps_to_ticks does
+    // not divide: the quotient is estimated using a precomputed 1.63 fixed
+    // point reciprocal and then corrected by comparing the full 128 bit
+    // products, so results are exactly those of mult_div_128. ticks_to_ps
+    // uses mult_div_128_round_up.
+    class clock_converter {
+    public:
+        clock_converter();
+
+        void setup(u64 clock);
+        u64  clock() const { return m_clock; }
+
+        u64 ps_to_ticks(u64 ps, bool& overflow) const;
+        u64 ticks_to_ps(u64 ticks, bool& overflow) const;
+
+    private:
+        u64  m_clock;
+        bool m_fast;
+        u64  m_ticks_per_ps; // clock / PS_PER_SEC, 1.63 fixed point
+    };
+
+}}
+
+#endif
@@ -0,0 +1,111 @@
+/******************************************************************************
+ * Copyright (C) 2019 Synopsys, Inc.
+ * This source code is licensed under the MIT license found in the
+ * LICENSE file in the root directory of this source tree.
+ ******************************************************************************/
+
+#include "dirtymap.h"
+
+#include <string.h>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+namespace ocx { namespace arm {
+
+    dirty_map::dirty_map():
+        m_chunks(),
+        m_count(0) {
+    }
+
+    bool dirty_map::mark(u64 page) {
+        chunk& c = m_chunks[page >> CHUNK_BITS];
+        const u64 bit = page & (CHUNK_PAGES - 1);
+        const u64 mask = 1ull << (bit % 64);
+
+        if (c.bits[bit / 64] & mask)
+            return false;
+
+        c.bits[bit / 64] |= mask;
+        c.count++;
+        m_count++;
+        return true;
+    }
+
+    bool dirty_map::test(u64 page) const {
+        auto it = m_chunks.find(page >> CHUNK_BITS);
+        if (it == m_chunks.end())
+            return false;
+
+        const u64 bit = page & (CHUNK_PAGES - 1);
+        return (it->second.bits[bit / 64] >> (bit % 64)) & 1;
+    }
+
+    void dirty_map::clear() {
+        m_chunks.clear();
+        m_count = 0;
+    }
+
+    static unsigned int lowest_bit(u64 val) {
+#ifdef _MSC_VER
+        unsigned long idx;
+        _BitScanForward64(&idx, val);
+        return (unsigned int)idx;
+#else
+        return (unsigned int)__builtin_ctzll(val);
+#endif
+    }
+
+    u64 dirty_map::fetch(u64* pages, u64 max) {
+        return fetch(0, ~0ull, max, pages, nullptr);
+    }
+
+    u64 dirty_map::fetch(u64 first, u64 n, u64* bitmap) {
+        memset(bitmap, 0, ((n + 63) / 64) * sizeof(u64));
+        return fetch(first, n, ~0ull, nullptr, bitmap);
+    }
+
+    u64 dirty_map::fetch(u64 first, u64 n, u64 max, u64* pages,
+                         u64* bitmap) {
+        const u64 last = n > ~first ? ~0ull : first + n; // exclusive
+
+        u64 found = 0;
+        auto it = m_chunks.lower_bound(first >> CHUNK_BITS);
+        while (it != m_chunks.end() && found < max &&
+               (it->first << CHUNK_BITS) < last) {
+            chunk& c = it->second;
+            const u64 base = it->first << CHUNK_BITS;
+
+            for (u64 w = 0; w < CHUNK_WORDS && found < max; w++) {
+                u64 bits = c.bits[w];
+                while (bits && found < max) {
+                    const unsigned int bit = lowest_bit(bits);
+                    bits &= bits - 1;
+
+                    const u64 page = base + w * 64 + bit;
+                    if (page < first || page >= last)
+                        continue;
+
+                    c.bits[w] &= ~(1ull << bit);
+                    c.count--;
+                    m_count--;
+
+                    if (pages)
+                        pages[found] = page;
+                    if (bitmap)
+                        bitmap[(page - first) / 64] |= 1ull << ((page - first) % 64);
+                    found++;
+                }
+            }
+
+            if (c.count == 0)
+                it = m_chunks.erase(it);
+            else
+                ++it;
+        }
+
+        return found;
+    }
+
+}}
@@ -0,0 +1,56 @@
+/******************************************************************************
+ * Copyright (C) 2019 Synopsys, Inc.
+ * This source code is licensed under the MIT license found in the
+ * LICENSE file in the root directory of this source tree.
+ ******************************************************************************/
+
+#ifndef DIRTYMAP_H
+#define DIRTYMAP_H
+
+#include <ocx/ocx.h>
+
+#include <map>
+
+namespace ocx { namespace arm {
+
+    // Sparse bitmap of page numbers, kept in chunks of 512 pages that are
+    // allocated on first use and dropped again once they are empty, so
+    // fetching costs time proportional to the number of dirty pages.
+    class dirty_map {
+    public:
+        dirty_map();
+
+        // returns true if the page was not marked before
+        bool mark(u64 page);
+        bool test(u64 page) const;
+        void clear();
+
+        u64 count() const { return m_count; }
+
+        // moves up to max marked pages into pages, in ascending order,
+        // and returns how many were moved
+        u64 fetch(u64* pages, u64 max);
+
+        // moves the marks of pages first to first+n-1 into bitmap (bit i
+        // of word i / 64 for page first+i) and returns the number set
+        u64 fetch(u64 first, u64 n, u64* bitmap);
+
+    private:
+        static const u64 CHUNK_BITS  = 9;
+        static const u64 CHUNK_PAGES = 1ull << CHUNK_BITS;
+        static const u64 CHUNK_WORDS = CHUNK_PAGES / 64;
+
+        struct chunk {
+            u64 bits[CHUNK_WORDS];
+            u64 count;
+        };
+
+        std::map<u64, chunk> m_chunks;
+        u64                  m_count;
+
+        u64 fetch(u64 first, u64 n, u64 max, u64* pages, u64* bitmap);
+    };
+
+}}
+
+#endif
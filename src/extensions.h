@@ -0,0 +1,238 @@
+/******************************************************************************
+ * Copyright (C) 2019 Synopsys, Inc.
+ * This source code is licensed under the MIT license found in the
+ * LICENSE file in the root directory of this source tree.
+ ******************************************************************************/
+
+#ifndef EXTENSIONS_H
+#define EXTENSIONS_H
+
+#include <ocx/ocx.h>
+
+namespace ocx { namespace arm {
+
+    // Optional interfaces implemented by the qemu-arm core on top of the
+    // plain ocx::core API. Use dynamic_cast on the ocx::core pointer returned
+    // by create_instance to find out whether a given interface is available.
+
+    // Bulk register access. Register values are packed back to back into
+    // the buffer, each one taking reg_size(idx) bytes, in the order given by
+    // regids. If regids is nullptr, registers 0 to count-1 are used, so
+    // passing num_regs() as count transfers the complete register file.
+    class core_bulk_regs_extension {
+    public:
+        virtual u64  regs_size(const u64* regids, u64 count) = 0;
+        virtual bool read_regs(const u64* regids, u64 count, void* buf) = 0;
+        virtual bool write_regs(const u64* regids, u64 count,
+                                const void* buf) = 0;
+
+    protected:
+        virtual ~core_bulk_regs_extension() = default;
+    };
+
+    // Batched instruction tracing. If the env implements this interface,
+    // trace_insns(true) records executed instructions into a per-core buffer
+    // and hands them over in batches when the buffer is full and at the end
+    // of each step, instead of calling handle_trace_insn per instruction.
+    struct trace_insn_record {
+        u64 vaddr;
+        u64 size;
+    };
+
+    class env_trace_insns_batch_extension {
+    public:
+        virtual void handle_trace_insns(const trace_insn_record* records,
+                                        u64 count) = 0;
+
+    protected:
+        virtual ~env_trace_insns_batch_extension() = default;
+    };
+
+    // Filtered instruction tracing. Only instructions inside one of the
+    // given virtual address ranges (both bounds inclusive) are reported,
+    // using the same env interface as trace_insns(true). Bit n of el_mask
+    // selects tracing at ELn, zero means all ELs. A non-negative asid only
+    // traces instructions executed under that AArch64 ASID, 8 or 16 bits
+    // wide as selected by TCR_EL1.AS. Starting retranslates all code, as
+    // the ranges may map to any page; trace_insns(false) stops and only
+    // retranslates the pages translated while tracing.
+    struct trace_range {
+        u64 start;
+        u64 end;
+    };
+
+    class core_trace_filter_extension {
+    public:
+        virtual bool trace_insns_filtered(const trace_range* ranges,
+                                          u64 count, u32 el_mask,
+                                          i64 asid) = 0;
+
+    protected:
+        virtual ~core_trace_filter_extension() = default;
+    };
+
+    // Compressed branch tracing. Only non-sequential transfers of control
+    // are recorded, delta encoded with periodic sync packets, either into
+    // the file descriptor passed to branch_trace_start or, if that is
+    // negative, into a buffer returned by branch_trace_data. The decoder
+    // disassembles the code bytes currently visible to the core to
+    // reconstruct every executed instruction from such a stream. Blocks
+    // left early by an AArch64 exception end at its preferred return
+    // address; in AArch32, such blocks are reported as fully executed.
+    class branch_trace_listener {
+    public:
+        virtual void handle_insn(u64 vaddr, u64 size, const char* disasm) = 0;
+
+    protected:
+        virtual ~branch_trace_listener() = default;
+    };
+
+    class core_branch_trace_extension {
+    public:
+        virtual bool branch_trace_start(int fd) = 0;
+        virtual void branch_trace_stop() = 0;
+        virtual const u8* branch_trace_data(u64& size) = 0;
+        virtual bool branch_trace_decode(const u8* data, u64 size,
+                                         branch_trace_listener& l) = 0;
+
+    protected:
+        virtual ~core_branch_trace_extension() = default;
+    };
+
+    // Hot block profiling. Counts executions per basic block and, if
+    // enabled, per call path. profile_dump writes the most frequently
+    // executed blocks (all if limit is zero) with their first instruction,
+    // profile_dump_folded writes folded call stacks for flamegraphs.
+    class core_profile_extension {
+    public:
+        virtual bool profile_start(bool callstacks) = 0;
+        virtual void profile_stop() = 0;
+        virtual void profile_reset() = 0;
+        virtual bool profile_dump(int fd, u64 limit) = 0;
+        virtual bool profile_dump_folded(int fd) = 0;
+
+    protected:
+        virtual ~core_profile_extension() = default;
+    };
+
+    // Performance counters of the integration layer: number of calls into
+    // the env for MMIO, DMI, TLB broadcasts and timers and, if the param
+    // perf_counters is enabled, the host time in ns spent in those calls.
+    class core_perf_counters_extension {
+    public:
+        virtual u64         num_perf_counters() = 0;
+        virtual const char* perf_counter_name(u64 idx) = 0;
+        virtual u64         perf_counter(u64 idx) = 0;
+        virtual void        reset_perf_counters() = 0;
+
+    protected:
+        virtual ~core_perf_counters_extension() = default;
+    };
+
+    // Idle fast-forward. If the param idle_skip is enabled, a WFI executed
+    // while no interrupt line is raised ends the step early and parks the
+    // core: step then returns zero without executing anything until
+    // interrupt() raises a line or a timer event gets notified(). While
+    // idle returns true, deadline_ps holds the next generic timer event
+    // (UINT64_MAX if none is armed), so the env can skip time ahead to it.
+    // idle_cycles reports the timer counter cycles spent parked so far.
+    class core_idle_extension {
+    public:
+        virtual bool idle(u64& deadline_ps) = 0;
+        virtual u64  idle_cycles() = 0;
+
+    protected:
+        virtual ~core_idle_extension() = default;
+    };
+
+    // Reason for the last step to end. Stops requested while the step
+    // is already ending keep the first reason.
+    enum stop_reason {
+        STOP_BUDGET     = 0, // instruction budget used up
+        STOP_REQUEST    = 1, // stop() got called
+        STOP_YIELD      = 2, // the guest executed YIELD
+        STOP_IDLE       = 3, // the guest went idle, see core_idle_extension
+        STOP_POLLING    = 4, // the guest spins in a polling loop
+        STOP_BREAKPOINT = 5, // the env requested a stop at a breakpoint
+        STOP_WATCHPOINT = 6, // the env requested a stop at a watchpoint
+        STOP_DEADLINE   = 7, // step_until reached its target time
+        STOP_TIMER      = 8, // step_until reached the next timer deadline
+    };
+
+    class core_stop_reason_extension {
+    public:
+        virtual int stop_reason() = 0;
+
+    protected:
+        virtual ~core_stop_reason_extension() = default;
+    };
+
+    // Deadline driven stepping. step_until runs until the simulated time
+    // target_ps, the next generic timer deadline known to the core or
+    // num_insn instructions (zero meaning no limit), whatever comes first,
+    // and returns the number of executed instructions; stop_reason tells
+    // which one it was. Time advances by the local time-keeping rate, or
+    // 1ns per instruction if local_time_clock is not set. Timers scheduled
+    // by the guest during the run shorten it accordingly.
+    class core_step_until_extension {
+    public:
+        virtual u64 step_until(u64 target_ps, u64 num_insn) = 0;
+
+    protected:
+        virtual ~core_step_until_extension() = default;
+    };
+
+    // Checkpointing. checkpoint_save streams the architectural state of
+    // the core, i.e. every register of the model including vector, system
+    // and generic timer registers, plus the pending timer deadlines, to fd
+    // in a versioned binary format; checkpoint_restore reads it back into
+    // a core of the same model and notifies the env of every timer again.
+    // The (V-)MPIDR values set up by set_id are kept, and the exclusive
+    // monitor is cleared, so a pending STREX fails after a restore. Memory
+    // is owned by the env and not included.
+    class core_checkpoint_extension {
+    public:
+        virtual bool checkpoint_save(int fd) = 0;
+        virtual bool checkpoint_restore(int fd) = 0;
+
+    protected:
+        virtual ~core_checkpoint_extension() = default;
+    };
+
+    // Dirty page tracking. While enabled, the core records every physical
+    // page it writes to, via DMI as well as via transport. The fetch calls
+    // return and clear the recorded pages: dirty_pages_fetch fills pages
+    // with up to max page addresses in ascending order, the bitmap variant
+    // covers npages pages from start, one bit per page. Both return the
+    // number of dirty pages reported. Writes to clean pages bypass DMI
+    // until the end of the step in which they were first written.
+    class core_dirty_pages_extension {
+    public:
+        virtual bool dirty_pages_track(bool on) = 0;
+        virtual u64  dirty_pages_fetch(u64* pages, u64 max) = 0;
+        virtual u64  dirty_pages_fetch_bitmap(u64 start, u64 npages,
+                                              u64* bitmap) = 0;
+
+    protected:
+        virtual ~core_dirty_pages_extension() = default;
+    };
+
+    // Large DMI regions. An env implementing this interface can grant
+    // direct access to a host contiguous region of any size (e.g. 2 MiB or
+    // 1 GiB) containing addr. It returns the host pointer for start and
+    // fills in start and size of the region, or returns nullptr to make the
+    // core fall back to get_page_ptr_r/w. The core serves every page of the
+    // region from that pointer until an overlapping invalidate_page_ptr(s)
+    // call drops it again.
+    class env_dmi_region_extension {
+    public:
+        virtual u8* get_region_ptr(u64 addr, bool iswr, u64& start,
+                                   u64& size) = 0;
+
+    protected:
+        virtual ~env_dmi_region_extension() = default;
+    };
+
+}}
+
+#endif
@@ -148,6 +148,20 @@ namespace ocx { namespace arm {
         { UC_ARM64_REG_VPIDR,   0, 64, "VPIDR_EL2"  },
         { UC_ARM64_REG_VMPIDR,  0, 64, "VMPIDR_EL1" },
 
+        /* aarch64 memory management registers */
+        { UC_ARM64_REG_TTBR0_EL1, 0, 64, "TTBR0_EL1" },
+        { UC_ARM64_REG_TTBR1_EL1, 0, 64, "TTBR1_EL1" },
+        { UC_ARM64_REG_TCR_EL1,   0, 64, "TCR_EL1"   },
+        { UC_ARM64_REG_MAIR_EL1,  0, 64, "MAIR_EL1"  },
+        { UC_ARM64_REG_FAR_EL1,   0, 64, "FAR_EL1"   },
+        { UC_ARM64_REG_PAR_EL1,   0, 64, "PAR_EL1"   },
+
+        /* aarch64 generic timer registers */
+        { UC_ARM64_REG_CNTP_CTL_EL0,  0, 64, "CNTP_CTL_EL0"  },
+        { UC_ARM64_REG_CNTP_CVAL_EL0, 0, 64, "CNTP_CVAL_EL0" },
+        { UC_ARM64_REG_CNTV_CTL_EL0,  0, 64, "CNTV_CTL_EL0"  },
+        { UC_ARM64_REG_CNTV_CVAL_EL0, 0, 64, "CNTV_CVAL_EL0" },
+
         /* aarch64 cpacr register */
 
         { UC_ARM64_REG_CPACR_EL1, 0, 64,    "CPACR_EL1"     },
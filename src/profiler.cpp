@@ -0,0 +1,166 @@
+/******************************************************************************
+ * Copyright (C) 2019 Synopsys, Inc.
+ * This source code is licensed under the MIT license found in the
+ * LICENSE file in the root directory of this source tree.
+ ******************************************************************************/
+
+#include "profiler.h"
+
+#include <algorithm>
+#include <inttypes.h>
+#include <stdio.h>
+
+namespace ocx { namespace arm {
+
+    static const size_t BBPROFILE_INITIAL_SIZE = 1 << 12;
+
+    // calls nested deeper than this are attributed to the deepest frame
+    static const size_t BBPROFILE_MAX_DEPTH = 256;
+
+    static size_t hash_pc(u64 pc) {
+        // fibonacci hashing, instructions are at least 2 byte aligned
+        return (size_t)(((pc >> 1) * 0x9e3779b97f4a7c15ull) >> 16);
+    }
+
+    bbprofile::bbprofile():
+        m_table(BBPROFILE_INITIAL_SIZE),
+        m_used(0),
+        m_total(0),
+        m_nodes(),
+        m_stack(),
+        m_children() {
+        clear();
+    }
+
+    bbprofile_entry* bbprofile::record(u64 pc) {
+        m_total++;
+
+        const size_t mask = m_table.size() - 1;
+        for (size_t i = hash_pc(pc) & mask;; i = (i + 1) & mask) {
+            bbprofile_entry& e = m_table[i];
+            if (e.count && e.pc == pc) {
+                e.count++;
+                return &e;
+            }
+
+            if (e.count == 0)
+                break;
+        }
+
+        // keep the load factor below one half
+        if (2 * (m_used + 1) > m_table.size())
+            grow();
+
+        for (size_t i = hash_pc(pc) & (m_table.size() - 1);;
+             i = (i + 1) & (m_table.size() - 1)) {
+            bbprofile_entry& e = m_table[i];
+            if (e.count == 0) {
+                e.pc = pc;
+                e.count = 1;
+                e.term = pc;
+                e.kind = BBPROFILE_UNKNOWN;
+                m_used++;
+                return &e;
+            }
+        }
+    }
+
+    void bbprofile::grow() {
+        std::vector<bbprofile_entry> old(m_table.size() * 2);
+        old.swap(m_table);
+
+        const size_t mask = m_table.size() - 1;
+        for (const bbprofile_entry& e : old) {
+            if (e.count == 0)
+                continue;
+
+            size_t i = hash_pc(e.pc) & mask;
+            while (m_table[i].count)
+                i = (i + 1) & mask;
+            m_table[i] = e;
+        }
+    }
+
+    u32 bbprofile::child(u32 parent, u64 func) {
+        auto key = std::make_pair(parent, func);
+        auto it = m_children.find(key);
+        if (it != m_children.end())
+            return it->second;
+
+        u32 id = (u32)m_nodes.size();
+        m_nodes.push_back({ func, parent, 0 });
+        m_children[key] = id;
+        return id;
+    }
+
+    void bbprofile::enter(u64 pc, u64 from, u32 kind, u64 term) {
+        // a block that got split by the translator continues inside the
+        // range covered by its classification and is no transfer at all
+        const bool transfer = pc <= from || pc >= term;
+
+        if (transfer && kind == BBPROFILE_CALL) {
+            if (m_stack.size() < BBPROFILE_MAX_DEPTH)
+                m_stack.push_back({ child(m_stack.back().node, pc), term });
+        } else if (transfer && kind == BBPROFILE_RET) {
+            // unwind to the matching frame, ignore returns we did not see
+            // the call for (e.g. exception returns)
+            for (size_t i = m_stack.size() - 1; i > 0; i--) {
+                if (m_stack[i].retaddr == pc) {
+                    m_stack.resize(i);
+                    break;
+                }
+            }
+        }
+
+        m_nodes[m_stack.back().node].count++;
+    }
+
+    void bbprofile::clear() {
+        std::fill(m_table.begin(), m_table.end(), bbprofile_entry());
+        m_used = 0;
+        m_total = 0;
+
+        m_nodes.assign(1, { 0, 0, 0 });
+        m_stack.assign(1, { 0, 0 });
+        m_children.clear();
+    }
+
+    void bbprofile::sorted(std::vector<bbprofile_entry>& entries) const {
+        entries.clear();
+        for (const bbprofile_entry& e : m_table)
+            if (e.count)
+                entries.push_back(e);
+
+        std::sort(entries.begin(), entries.end(),
+                  [](const bbprofile_entry& a, const bbprofile_entry& b) {
+            return a.count != b.count ? a.count > b.count : a.pc < b.pc;
+        });
+    }
+
+    void bbprofile::folded(std::string& text) const {
+        // one line per call path: "root;func;func count", as expected by
+        // flamegraph.pl and similar tools
+        text.clear();
+
+        char buf[32];
+        std::vector<u32> path;
+        for (u32 id = 0; id < m_nodes.size(); id++) {
+            if (m_nodes[id].count == 0)
+                continue;
+
+            path.clear();
+            for (u32 n = id; n != 0; n = m_nodes[n].parent)
+                path.push_back(n);
+
+            text += "root";
+            for (auto it = path.rbegin(); it != path.rend(); ++it) {
+                snprintf(buf, sizeof(buf), ";0x%" PRIx64, m_nodes[*it].func);
+                text += buf;
+            }
+
+            snprintf(buf, sizeof(buf), " %" PRIu64 "\n", m_nodes[id].count);
+            text += buf;
+        }
+    }
+
+}}
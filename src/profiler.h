@@ -0,0 +1,87 @@
+/******************************************************************************
+ * Copyright (C) 2019 Synopsys, Inc.
+ * This source code is licensed under the MIT license found in the
+ * LICENSE file in the root directory of this source tree.
+ ******************************************************************************/
+
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <ocx/ocx.h>
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+namespace ocx { namespace arm {
+
+    enum bbprofile_kind {
+        BBPROFILE_UNKNOWN = 0, // not classified (yet)
+        BBPROFILE_OTHER   = 1, // block ends in a plain jump or falls through
+        BBPROFILE_CALL    = 2, // block ends in a call
+        BBPROFILE_RET     = 3, // block ends in a return
+    };
+
+    struct bbprofile_entry {
+        u64 pc;    // start address of the block
+        u64 count; // number of executions, zero marks an empty slot
+        u64 term;  // address following the instruction ending the block
+        u32 kind;  // bbprofile_kind of that instruction
+    };
+
+    // Execution counts per basic block start address, kept in an open
+    // addressing hash table with linear probing. Optionally also tracks a
+    // shadow call stack to attribute executions to call paths.
+    class bbprofile {
+    public:
+        bbprofile();
+
+        // counts an execution of the block at pc and returns its entry,
+        // which stays valid until the next call to record; new entries
+        // start out as BBPROFILE_UNKNOWN
+        bbprofile_entry* record(u64 pc);
+
+        // update the shadow call stack for a transfer from the block at
+        // from (described by kind and term) to the block at pc
+        void enter(u64 pc, u64 from, u32 kind, u64 term);
+
+        void clear();
+
+        u64 total() const { return m_total; }
+
+        void sorted(std::vector<bbprofile_entry>& entries) const;
+        void folded(std::string& text) const;
+
+    private:
+        struct node {
+            u64 func;
+            u32 parent;
+            u64 count;
+        };
+
+        struct frame {
+            u32 node;
+            u64 retaddr;
+        };
+
+        struct node_key_hash {
+            size_t operator()(const std::pair<u32, u64>& k) const {
+                return std::hash<u64>()(k.second * 31 + k.first);
+            }
+        };
+
+        std::vector<bbprofile_entry> m_table;
+        size_t                       m_used;
+        u64                          m_total;
+
+        std::vector<node>  m_nodes;
+        std::vector<frame> m_stack;
+        std::unordered_map<std::pair<u32, u64>, u32, node_key_hash> m_children;
+
+        void grow();
+        u32  child(u32 parent, u64 func);
+    };
+
+}}
+
+#endif